@@ -22,28 +22,6 @@ size_t Array<DataType>::countLines (const int dim) const
     return n;
 }
 
-template <typename DataType>
-size_t Array<DataType>::lineOffset (const size_t n, const int dim) const
-{
-    std::vector<int> loc(nDims);
-    size_t result, stride = 1;
-    
-    for (int i=0; i<nDims; i++)
-    {
-        if (i == dim)
-            loc[i] = 0;
-        else
-        {
-            // Usual stride doesn't apply because we're missing out one dimension
-            loc[i] = (n / stride) % dims[i];
-            stride *= dims[i];
-        }
-    }
-    
-    flattenIndex(loc, result);
-    return result;
-}
-
 template <typename DataType>
 Neighbourhood Array<DataType>::getNeighbourhood () const
 {
@@ -154,3 +132,6 @@ void Array<DataType>::expandIndex (const size_t &loc, std::vector<int> &result)
 // Tell the compiler that we're going to need these specialisations (otherwise
 // it won't generate the relevant code and we'll get a linker error)
 template class Array<double>;
+template class Array<int>;
+template class Array<unsigned char>;
+template class Array<float>;
@@ -3,6 +3,8 @@
 
 #include <Rcpp.h>
 
+#include "MappedFile.h"
+
 struct Neighbourhood
 {
     size_t size;
@@ -11,10 +13,72 @@ struct Neighbourhood
     std::vector<ptrdiff_t> offsets;
 };
 
+// A block of consecutive lines along one dimension of an array, starting at
+// the specified offset. Corresponding elements of the lines are adjacent in
+// memory
+struct LineBlock
+{
+    size_t offset;
+    size_t count;
+};
+
+// The number of lines in a block used by separable operations. Sixteen
+// doubles span two typical cache lines
+const size_t lineBlockWidth = 16;
+
+// Conversions between array element types and double precision, for use where
+// values are combined arithmetically. Missing values are preserved where the
+// type can represent them; otherwise they become zero. Integral types can't
+// represent infinities either, which are treated in the same way
+template <typename DataType>
+struct ElementTraits
+{
+    static bool isNA (const DataType x) { return false; }
+    static double toDouble (const DataType x) { return static_cast<double>(x); }
+    static DataType fromDouble (const double x) { return R_FINITE(x) ? static_cast<DataType>(x) : DataType(0); }
+};
+
+template <>
+struct ElementTraits<double>
+{
+    static bool isNA (const double x) { return R_IsNA(x); }
+    static double toDouble (const double x) { return x; }
+    static double fromDouble (const double x) { return x; }
+};
+
+// R's integer and logical types use the most negative integer for NA
+template <>
+struct ElementTraits<int>
+{
+    static bool isNA (const int x) { return (x == NA_INTEGER); }
+    static double toDouble (const int x) { return (x == NA_INTEGER) ? NA_REAL : static_cast<double>(x); }
+    static int fromDouble (const double x) { return R_FINITE(x) ? static_cast<int>(x) : NA_INTEGER; }
+};
+
+// Single-precision floats can't hold R's NA payload, so any NaN counts as NA
+template <>
+struct ElementTraits<float>
+{
+    static bool isNA (const float x) { return ISNAN(x); }
+    static double toDouble (const float x) { return ISNAN(x) ? NA_REAL : static_cast<double>(x); }
+    static float fromDouble (const double x) { return static_cast<float>(x); }
+};
+
+// An array may own its data, or be a view onto an existing buffer (such as the
+// contents of an R vector), which is not copied. In the latter case the buffer
+// must outlive the array, and is not freed with it. A view may instead be onto
+// a memory-mapped file, which the array takes over and unmaps when it is
+// destroyed. All element access goes through the elements pointer, which
+// refers to one or the other
 template <typename DataType> class Array
 {
 protected:
     std::vector<DataType> data;
+    DataType *elements;
+    size_t nElements;
+    bool view;
+    MappedFile *mapping;
+    
     std::vector<int> dims;
     std::vector<double> pixdims;
     int nDims;
@@ -66,6 +130,13 @@ protected:
         for (int i=0; i<nDims; i++)
             strides[i+1] = strides[i] * size_t(dims[i]);
     }
+    
+    void attachData ()
+    {
+        elements = data.empty() ? NULL : &data.front();
+        nElements = data.size();
+        view = false;
+    }
 
 public:
     typedef IteratorType<const DataType> ConstIterator;
@@ -73,10 +144,11 @@ public:
     typedef const DataType & ConstReference;
     typedef DataType & Reference;
     
-    Array () { nDims = 0; }
+    Array ()
+        : elements(NULL), nElements(0), view(false), mapping(NULL) { nDims = 0; }
     
     Array (const std::vector<int> &dims, const DataType &value)
-        : dims(dims)
+        : mapping(NULL), dims(dims)
     {
         nDims = dims.size();
         pixdims = std::vector<double>(nDims, 1.0);
@@ -87,32 +159,85 @@ public:
             length *= dims[i];
         
         data = std::vector<DataType>(length, value);
+        attachData();
     }
     
     Array (const std::vector<int> &dims, const std::vector<DataType> &data)
-        : data(data), dims(dims)
+        : data(data), mapping(NULL), dims(dims)
     {
         nDims = dims.size();
         pixdims = std::vector<double>(nDims, 1.0);
         calculateStrides();
+        attachData();
     }
     
+    // Construct a view onto an existing buffer, whose length must match the
+    // dimensions given
+    Array (const std::vector<int> &dims, DataType * const buffer)
+        : elements(buffer), view(true), mapping(NULL), dims(dims)
+    {
+        nDims = dims.size();
+        pixdims = std::vector<double>(nDims, 1.0);
+        calculateStrides();
+        nElements = strides[nDims];
+    }
+    
+    // Construct a view onto a mapped file, which must be large enough to hold
+    // the data. The array takes ownership of the mapping, even if this fails
+    Array (const std::vector<int> &dims, MappedFile * const file)
+        : view(true), mapping(file), dims(dims)
+    {
+        nDims = dims.size();
+        pixdims = std::vector<double>(nDims, 1.0);
+        calculateStrides();
+        nElements = strides[nDims];
+        if (file->size() < nElements * sizeof(DataType))
+        {
+            delete mapping;
+            throw std::runtime_error("Mapped file is too small for the array dimensions");
+        }
+        elements = static_cast<DataType *>(file->data());
+    }
+    
+    // Copying always produces an array that owns its data, even if the
+    // original is a view
     Array (const Array<DataType> &other)
-        : data(other.data), dims(other.dims), pixdims(other.pixdims)
+        : data(other.elements, other.elements + other.nElements), mapping(NULL), dims(other.dims), pixdims(other.pixdims)
     {
         nDims = dims.size();
         calculateStrides();
+        attachData();
+    }
+    
+    ~Array () { delete mapping; }
+    
+    Array<DataType> & operator= (const Array<DataType> &other)
+    {
+        if (this != &other)
+        {
+            data.assign(other.elements, other.elements + other.nElements);
+            delete mapping;
+            mapping = NULL;
+            dims = other.dims;
+            pixdims = other.pixdims;
+            nDims = dims.size();
+            calculateStrides();
+            attachData();
+        }
+        return *this;
     }
     
-    size_t size () const { return data.size(); }
-    bool empty () const { return (data.size() == 0); }
+    size_t size () const { return nElements; }
+    bool empty () const { return (nElements == 0); }
+    bool isView () const { return view; }
+    bool isMapped () const { return (mapping != NULL); }
     
-    void fill (const DataType &value) { data.assign(data.size(), value); }
+    void fill (const DataType &value) { std::fill(elements, elements + nElements, value); }
     
-    ConstIterator begin () const { return ConstIterator(&data.front()); }
-    Iterator begin () { return Iterator(&data.front()); }
-    ConstIterator end () const { return ConstIterator(&data.back() + 1); }
-    Iterator end () { return Iterator(&data.back() + 1); }
+    ConstIterator begin () const { return ConstIterator(elements); }
+    Iterator begin () { return Iterator(elements); }
+    ConstIterator end () const { return ConstIterator(elements + nElements); }
+    Iterator end () { return Iterator(elements + nElements); }
     
     ConstIterator beginLine (const std::vector<int> &begin, const int dim) const { return ConstIterator(&at(begin), strides[dim]); }
     Iterator beginLine (const std::vector<int> &begin, const int dim) { return Iterator(&at(begin), strides[dim]); }
@@ -128,37 +253,112 @@ public:
     }
     
     // The index n here is the line number; it doesn't match the argument to at()
-    ConstIterator beginLine (const size_t n, const int dim) const { return ConstIterator(&data.front() + lineOffset(n,dim), strides[dim]); }
-    Iterator beginLine (const size_t n, const int dim) { return Iterator(&data.front() + lineOffset(n,dim), strides[dim]); }
+    ConstIterator beginLine (const size_t n, const int dim) const { return ConstIterator(elements + lineOffset(n,dim), strides[dim]); }
+    Iterator beginLine (const size_t n, const int dim) { return Iterator(elements + lineOffset(n,dim), strides[dim]); }
     ConstIterator endLine (const size_t n, const int dim) const { return beginLine(n,dim) + dims[dim]; }
     Iterator endLine (const size_t n, const int dim) { return beginLine(n,dim) + dims[dim]; }
     
-    ConstReference at (const size_t n) const { return data.at(n); }
-    ConstReference at (const std::vector<int> &loc) const { return data.at(flattenIndex(loc)); }
+    ConstReference at (const size_t n) const { checkIndex(n); return elements[n]; }
+    ConstReference at (const std::vector<int> &loc) const { return at(flattenIndex(loc)); }
     
-    Reference at (const size_t n) { return data.at(n); }
-    Reference at (const std::vector<int> &loc) { return data.at(flattenIndex(loc)); }
+    Reference at (const size_t n) { checkIndex(n); return elements[n]; }
+    Reference at (const std::vector<int> &loc) { return at(flattenIndex(loc)); }
     
-    ConstReference operator[] (const size_t n) const { return data[n]; }
-    ConstReference operator[] (const std::vector<int> &loc) const { return data[flattenIndex(loc)]; }
+    ConstReference operator[] (const size_t n) const { return elements[n]; }
+    ConstReference operator[] (const std::vector<int> &loc) const { return elements[flattenIndex(loc)]; }
     
-    Reference operator[] (const size_t n) { return data[n]; }
-    Reference operator[] (const std::vector<int> &loc) { return data[flattenIndex(loc)]; }
+    Reference operator[] (const size_t n) { return elements[n]; }
+    Reference operator[] (const std::vector<int> &loc) { return elements[flattenIndex(loc)]; }
     
-    const std::vector<DataType> & getData () const { return data; }
+    // The data vector is only available for arrays that own their data
+    const std::vector<DataType> & getData () const
+    {
+        if (view)
+            throw std::runtime_error("Array is a view onto external data");
+        return data;
+    }
     const std::vector<int> & getDimensions () const { return dims; }
     int getDimensionality () const { return nDims; }
     const std::vector<double> & getPixelDimensions () const { return pixdims; }
+    const std::vector<size_t> & getStrides () const { return strides; }
     
     void setPixelDimensions (const std::vector<double> &newPixdims);
     
     size_t countLines (const int dim) const;
-    size_t lineOffset (const size_t n, const int dim) const;
+    
+    // Lines along a dimension are numbered by the indices of the remaining
+    // dimensions, in the usual order. Those below the line dimension keep
+    // their usual strides, while those above it skip over its whole extent,
+    // so the offset needs only one division, and none for the first dimension
+    size_t lineOffset (const size_t n, const int dim) const
+    {
+        if (dim == 0)
+            return n * strides[1];
+        
+        const size_t upper = n / strides[dim];
+        return (n - upper * strides[dim]) + upper * strides[dim+1];
+    }
+    
+    // Lines along any dimension but the first are adjacent in memory when
+    // their numbers are consecutive, within runs of strides[dim] lines. They
+    // can therefore be processed in blocks of up to the specified width, which
+    // are gathered into a contiguous tile with each line stored consecutively,
+    // and then scattered back. The strided accesses are then shared between
+    // the lines in each block, so they make much better use of the cache.
+    // Blocks don't span runs, and along the first dimension they are single
+    // lines, which are already contiguous
+    size_t countLineBlocks (const int dim, const size_t width) const
+    {
+        const size_t run = (dim == 0 ? 1 : strides[dim]);
+        if (run == 0)
+            return 0;
+        return ((run + width - 1) / width) * (countLines(dim) / run);
+    }
+    
+    LineBlock lineBlock (const size_t n, const int dim, const size_t width) const
+    {
+        const size_t run = (dim == 0 ? 1 : strides[dim]);
+        const size_t blocksPerRun = (run + width - 1) / width;
+        const size_t firstInRun = (n % blocksPerRun) * width;
+        
+        LineBlock block;
+        block.offset = lineOffset((n / blocksPerRun) * run + firstInRun, dim);
+        block.count = std::min(width, run - firstInRun);
+        return block;
+    }
+    
+    void gatherLines (const LineBlock &block, const int dim, DataType * const tile) const
+    {
+        const size_t len = dims[dim];
+        const DataType *source = elements + block.offset;
+        for (size_t l=0; l<len; l++, source += strides[dim])
+        {
+            for (size_t k=0; k<block.count; k++)
+                tile[k*len + l] = source[k];
+        }
+    }
+    
+    void scatterLines (const LineBlock &block, const int dim, const DataType * const tile)
+    {
+        const size_t len = dims[dim];
+        DataType *target = elements + block.offset;
+        for (size_t l=0; l<len; l++, target += strides[dim])
+        {
+            for (size_t k=0; k<block.count; k++)
+                target[k] = tile[k*len + l];
+        }
+    }
     
     Neighbourhood getNeighbourhood () const;
     Neighbourhood getNeighbourhood (const int width) const;
     Neighbourhood getNeighbourhood (const std::vector<int> &widths) const;
     
+    void checkIndex (const size_t n) const
+    {
+        if (n >= nElements)
+            throw std::out_of_range("Array index out of bounds");
+    }
+    
     void flattenIndex (const std::vector<int> &loc, size_t &result) const;
     void expandIndex (const size_t &loc, std::vector<int> &result) const;
     
@@ -0,0 +1,172 @@
+#include <Rcpp.h>
+
+#include "Automaton.h"
+#include "Parallel.h"
+
+// Add a word of single-bit values to the bit-sliced counters, one carry at a
+// time. Five planes are enough for up to 31 neighbours
+static inline void addWord (uint64_t * const planes, uint64_t carry)
+{
+    for (int b=0; b<5 && carry != 0; b++)
+    {
+        const uint64_t overflow = planes[b] & carry;
+        planes[b] ^= carry;
+        carry = overflow;
+    }
+}
+
+// The bits whose counters hold a particular value
+static inline uint64_t countEquals (const uint64_t * const planes, const int count)
+{
+    uint64_t result = ~uint64_t(0);
+    for (int b=0; b<5; b++)
+        result &= ((count >> b) & 1) ? planes[b] : ~planes[b];
+    return result;
+}
+
+Automaton::Automaton (const std::vector<int> &dims, const std::vector<int> &birth, const std::vector<int> &survival)
+    : dims(dims), birth(birth), survival(survival)
+{
+    nDims = dims.size();
+    if (nDims < 1 || nDims > 3)
+        throw std::runtime_error("Cellular automata must have between one and three dimensions");
+    
+    nWords = (dims[0] + 63) / 64;
+    nLines = 1;
+    lineNeighbourhoodSize = 1;
+    for (int i=1; i<nDims; i++)
+    {
+        nLines *= dims[i];
+        lineNeighbourhoodSize *= 3;
+    }
+    
+    // Bits beyond the end of each line must stay clear
+    const int remainder = dims[0] % 64;
+    lastWordMask = (remainder == 0) ? ~Word(0) : ((Word(1) << remainder) - 1);
+    
+    const int maxCount = 3 * lineNeighbourhoodSize - 1;
+    for (size_t i=0; i<birth.size(); i++)
+    {
+        if (birth[i] < 0 || birth[i] > maxCount)
+            throw std::runtime_error("Birth counts must be between 0 and the number of neighbours");
+    }
+    for (size_t i=0; i<survival.size(); i++)
+    {
+        if (survival[i] < 0 || survival[i] > maxCount)
+            throw std::runtime_error("Survival counts must be between 0 and the number of neighbours");
+    }
+    
+    state.assign(nWords * nLines, Word(0));
+    next.assign(nWords * nLines, Word(0));
+    
+    // Lines are indexed by their locations in the remaining dimensions, and
+    // those adjacent to each one are found once, here
+    neighbourLines.resize(nLines * lineNeighbourhoodSize);
+    std::vector<int> loc(nDims, 0);
+    for (size_t l=0; l<nLines; l++)
+    {
+        size_t remaining = l;
+        for (int i=1; i<nDims; i++)
+        {
+            loc[i] = remaining % dims[i];
+            remaining /= dims[i];
+        }
+        
+        for (size_t k=0; k<lineNeighbourhoodSize; k++)
+        {
+            size_t offsets = k;
+            ptrdiff_t index = 0, stride = 1;
+            bool valid = true;
+            for (int i=1; i<nDims; i++)
+            {
+                const int neighbourLoc = loc[i] + int(offsets % 3) - 1;
+                offsets /= 3;
+                if (neighbourLoc < 0 || neighbourLoc >= dims[i])
+                    valid = false;
+                index += neighbourLoc * stride;
+                stride *= dims[i];
+            }
+            neighbourLines[l * lineNeighbourhoodSize + k] = valid ? index : -1;
+        }
+    }
+}
+
+void Automaton::setState (const int * const cells)
+{
+    std::fill(state.begin(), state.end(), Word(0));
+    for (size_t l=0; l<nLines; l++)
+    {
+        const int *line = cells + l * dims[0];
+        Word *words = &state[l * nWords];
+        for (int x=0; x<dims[0]; x++)
+        {
+            if (line[x] != 0)
+                words[x / 64] |= Word(1) << (x % 64);
+        }
+    }
+}
+
+void Automaton::getState (int * const cells) const
+{
+    for (size_t l=0; l<nLines; l++)
+    {
+        int *line = cells + l * dims[0];
+        const Word *words = &state[l * nWords];
+        for (int x=0; x<dims[0]; x++)
+            line[x] = static_cast<int>((words[x / 64] >> (x % 64)) & 1);
+    }
+}
+
+void Automaton::updateLine (const size_t line)
+{
+    const ptrdiff_t *neighbours = &neighbourLines[line * lineNeighbourhoodSize];
+    const size_t centre = (lineNeighbourhoodSize - 1) / 2;
+    const Word *current = &state[line * nWords];
+    Word *result = &next[line * nWords];
+    
+    for (size_t j=0; j<nWords; j++)
+    {
+        // Each adjacent line contributes its cells shifted one place either
+        // way along the line, as well as those level with the current word,
+        // except in the current line itself
+        Word planes[5] = { 0, 0, 0, 0, 0 };
+        for (size_t k=0; k<lineNeighbourhoodSize; k++)
+        {
+            if (neighbours[k] < 0)
+                continue;
+            
+            const Word *words = &state[neighbours[k] * nWords];
+            const Word lower = (words[j] << 1) | (j > 0 ? (words[j-1] >> 63) : Word(0));
+            const Word upper = (words[j] >> 1) | (j < nWords - 1 ? (words[j+1] << 63) : Word(0));
+            addWord(planes, lower);
+            addWord(planes, upper);
+            if (k != centre)
+                addWord(planes, words[j]);
+        }
+        
+        Word born = 0, survives = 0;
+        for (size_t i=0; i<birth.size(); i++)
+            born |= countEquals(planes, birth[i]);
+        for (size_t i=0; i<survival.size(); i++)
+            survives |= countEquals(planes, survival[i]);
+        
+        result[j] = (born & ~current[j]) | (survives & current[j]);
+    }
+    
+    result[nWords-1] &= lastWordMask;
+}
+
+bool Automaton::step ()
+{
+    if (state.empty())
+        return false;
+    
+    // Lines are independent within each generation
+    PARALLEL_LOOP_START(l, nLines)
+        updateLine(l);
+    PARALLEL_LOOP_END
+    
+    const bool changed = (next != state);
+    state.swap(next);
+    return changed;
+}
@@ -0,0 +1,49 @@
+#ifndef _AUTOMATON_H_
+#define _AUTOMATON_H_
+
+#include <vector>
+#include <stdint.h>
+
+// A life-like cellular automaton on a grid of up to three dimensions, with
+// dead cells beyond its edges. A dead cell comes alive if its number of live
+// neighbours (including diagonal neighbours) is one of the birth counts, and
+// a live cell stays alive if its count is one of the survival counts.
+// Conway's Game of Life has birth count 3 and survival counts 2 and 3.
+//
+// The state is bit-packed along the first dimension, 64 cells to a word.
+// Neighbours are counted for a whole word at once, using bit-sliced adders
+// whose planes hold each binary digit of the 64 counts, so there is no
+// per-cell work at all
+class Automaton
+{
+private:
+    typedef uint64_t Word;
+    
+    std::vector<int> dims;
+    int nDims;
+    size_t nWords, nLines;
+    Word lastWordMask;
+    
+    std::vector<Word> state, next;
+    
+    // The counts that produce a live cell, and the indices of the lines
+    // adjacent to each line (including itself), or -1 beyond the edges
+    std::vector<int> birth, survival;
+    std::vector<ptrdiff_t> neighbourLines;
+    size_t lineNeighbourhoodSize;
+    
+    void updateLine (const size_t line);
+    
+public:
+    Automaton (const std::vector<int> &dims, const std::vector<int> &birth, const std::vector<int> &survival);
+    
+    // Copy the state in from, or out to, a buffer with one element per cell,
+    // in R's usual element order. Nonzero values represent live cells
+    void setState (const int * const cells);
+    void getState (int * const cells) const;
+    
+    // Advance one generation, returning false if the state didn't change
+    bool step ();
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include <Rcpp.h>
+
+#include "Array.h"
+#include "BilateralGrid.h"
+#include "Parallel.h"
+
+// Grids larger than this are almost certainly a mistake
+static const double maxGridSize = 1e9;
+
+BilateralGrid::BilateralGrid (const std::vector<int> &dims, const std::vector<double> &spatialSigmas, const double rangeSigma)
+    : dims(dims), spatialSigmas(spatialSigmas), rangeSigma(rangeSigma)
+{
+    if (spatialSigmas.size() != dims.size())
+        throw std::runtime_error("There must be one spatial standard deviation per dimension");
+    if (!(rangeSigma > 0.0))
+        throw std::runtime_error("The range standard deviation must be positive");
+}
+
+template <typename DataType>
+void BilateralGrid::run (const DataType * const source, double * const result) const
+{
+    const int nDims = static_cast<int>(dims.size());
+    size_t nSamples = 1;
+    for (int j=0; j<nDims; j++)
+        nSamples *= dims[j];
+    if (nSamples == 0)
+        return;
+    
+    std::vector<double> data(nSamples);
+    double minValue = R_PosInf, maxValue = R_NegInf;
+    for (size_t i=0; i<nSamples; i++)
+    {
+        data[i] = ElementTraits<DataType>::toDouble(source[i]);
+        if (R_FINITE(data[i]))
+        {
+            minValue = std::min(minValue, data[i]);
+            maxValue = std::max(maxValue, data[i]);
+        }
+    }
+    
+    if (!R_FINITE(minValue) || !R_FINITE(maxValue))
+    {
+        std::copy(data.begin(), data.end(), result);
+        return;
+    }
+    
+    // Sampling intervals along each dimension, the last being intensity.
+    // Dimensions without spatial smoothing are sampled at every element, and
+    // not blurred. The grid has a margin of one sample all round
+    std::vector<double> intervals(nDims + 1);
+    std::vector<int> gridDims(nDims + 1);
+    std::vector<size_t> gridStrides(nDims + 1);
+    double gridSize = 1.0;
+    for (int j=0; j<=nDims; j++)
+    {
+        const double extent = (j < nDims) ? static_cast<double>(dims[j] - 1) : maxValue - minValue;
+        intervals[j] = (j < nDims) ? std::max(1.0, spatialSigmas[j]) : rangeSigma;
+        const double nPoints = ceil(extent / intervals[j]) + 3.0;
+        gridSize *= nPoints;
+        if (!(gridSize <= maxGridSize))
+            throw std::runtime_error("The bilateral grid would be too large; try larger standard deviations");
+        gridDims[j] = static_cast<int>(nPoints);
+        gridStrides[j] = (j == 0) ? 1 : gridStrides[j-1] * gridDims[j-1];
+    }
+    
+    // Add each finite element to its nearest grid point, keeping the sum of
+    // values and their number, in homogeneous form
+    const size_t nGridPoints = static_cast<size_t>(gridSize);
+    std::vector<double> values(nGridPoints, 0.0), weights(nGridPoints, 0.0);
+    std::vector<int> loc(nDims, 0);
+    for (size_t i=0; i<nSamples; i++)
+    {
+        if (R_FINITE(data[i]))
+        {
+            size_t index = static_cast<size_t>((data[i] - minValue) / intervals[nDims] + 1.5) * gridStrides[nDims];
+            for (int j=0; j<nDims; j++)
+                index += static_cast<size_t>(loc[j] / intervals[j] + 1.5) * gridStrides[j];
+            values[index] += data[i];
+            weights[index] += 1.0;
+        }
+        
+        for (int j=0; j<nDims && ++loc[j] == dims[j]; j++)
+            loc[j] = 0;
+    }
+    
+    // Blur with a [1 2 1] kernel along each grid dimension in turn
+    std::vector<double> original;
+    for (int j=0; j<=nDims; j++)
+    {
+        if (j < nDims && spatialSigmas[j] <= 0.0)
+            continue;
+        
+        const size_t stride = gridStrides[j];
+        const int length = gridDims[j];
+        const size_t nBlocks = nGridPoints / (stride * length);
+        for (int channel=0; channel<2; channel++)
+        {
+            std::vector<double> &grid = (channel == 0) ? values : weights;
+            original = grid;
+            for (size_t b=0; b<nBlocks; b++)
+            {
+                const double * const in = &original[b * stride * length];
+                double * const out = &grid[b * stride * length];
+                for (int t=0; t<length; t++)
+                {
+                    for (size_t l=0; l<stride; l++)
+                    {
+                        const double before = (t > 0) ? in[(t-1) * stride + l] : 0.0;
+                        const double after = (t < length - 1) ? in[(t+1) * stride + l] : 0.0;
+                        out[t * stride + l] = 0.25 * before + 0.5 * in[t * stride + l] + 0.25 * after;
+                    }
+                }
+            }
+        }
+    }
+    
+    // Read the filtered values back by multilinear interpolation between the
+    // grid points around each element, one line of the array at a time
+    const int length = dims[0];
+    const size_t nLines = nSamples / length;
+    const size_t nCorners = size_t(1) << (nDims + 1);
+    const double * const dataPtr = &data.front();
+    const double * const valuesPtr = &values.front();
+    const double * const weightsPtr = &weights.front();
+    const int * const dimsPtr = &dims.front();
+    const double * const intervalsPtr = &intervals.front();
+    const size_t * const stridesPtr = &gridStrides.front();
+    
+    PARALLEL_LOOP_START(l, nLines)
+        std::vector<size_t> base(nDims + 1);
+        std::vector<double> fraction(nDims + 1);
+        
+        // The location of the line along the other dimensions is fixed
+        size_t remainder = l;
+        for (int j=1; j<nDims; j++)
+        {
+            const double position = (remainder % dimsPtr[j]) / intervalsPtr[j] + 1.0;
+            base[j] = static_cast<size_t>(position);
+            fraction[j] = position - base[j];
+            remainder /= dimsPtr[j];
+        }
+        
+        for (int t=0; t<length; t++)
+        {
+            const size_t i = l * length + t;
+            const double value = dataPtr[i];
+            if (!R_FINITE(value))
+            {
+                result[i] = value;
+                continue;
+            }
+            
+            const double position = t / intervalsPtr[0] + 1.0;
+            base[0] = static_cast<size_t>(position);
+            fraction[0] = position - base[0];
+            const double rangePosition = (value - minValue) / intervalsPtr[nDims] + 1.0;
+            base[nDims] = static_cast<size_t>(rangePosition);
+            fraction[nDims] = rangePosition - base[nDims];
+            
+            double numerator = 0.0, denominator = 0.0;
+            for (size_t c=0; c<nCorners; c++)
+            {
+                double weight = 1.0;
+                size_t index = 0;
+                for (int j=0; j<=nDims; j++)
+                {
+                    const bool upper = ((c >> j) & 1) != 0;
+                    weight *= upper ? fraction[j] : 1.0 - fraction[j];
+                    index += (base[j] + (upper ? 1 : 0)) * stridesPtr[j];
+                }
+                
+                numerator += weight * valuesPtr[index];
+                denominator += weight * weightsPtr[index];
+            }
+            
+            result[i] = (denominator > 0.0) ? numerator / denominator : value;
+        }
+    PARALLEL_LOOP_END
+}
+
+// Explicit instantiations for each supported element type
+template void BilateralGrid::run (const double * const source, double * const result) const;
+template void BilateralGrid::run (const int * const source, double * const result) const;
+template void BilateralGrid::run (const unsigned char * const source, double * const result) const;
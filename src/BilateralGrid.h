@@ -0,0 +1,29 @@
+#ifndef _BILATERAL_GRID_H_
+#define _BILATERAL_GRID_H_
+
+#include <vector>
+
+// A fast approximation to the bilateral filter, using a grid with one more
+// dimension than the array, for intensity. The grid is sampled at intervals
+// of the spatial and range standard deviations, so it is much smaller than
+// the array for wide filters. Each array element is added to the nearest
+// grid point, the grid is blurred, and filtered values are read back by
+// multilinear interpolation (Paris & Durand, 2009)
+class BilateralGrid
+{
+private:
+    std::vector<int> dims;
+    std::vector<double> spatialSigmas;
+    double rangeSigma;
+    
+public:
+    BilateralGrid (const std::vector<int> &dims, const std::vector<double> &spatialSigmas, const double rangeSigma);
+    
+    // Write the filtered array into the buffer given, which must have the
+    // same length as the source. Missing, NaN and infinite values are
+    // ignored, and copied unchanged
+    template <typename DataType>
+    void run (const DataType * const source, double * const result) const;
+};
+
+#endif
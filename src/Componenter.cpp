@@ -7,7 +7,8 @@
 
 using namespace lemon;
 
-std::vector<int> & Componenter::run ()
+template <typename DataType>
+void Componenter<DataType>::run (int * const labels)
 {
     Array<double> * kernelArray = kernel->getArray();
     const Neighbourhood &kernelNeighbourhood = kernelArray->getNeighbourhood();
@@ -17,18 +18,29 @@ std::vector<int> & Componenter::run ()
     const std::vector<int> &dims = original->getDimensions();
     const int nDims = original->getDimensionality();
     const size_t nLabels = original->size();
-    labels.resize(nLabels, NA_INTEGER);
+    std::fill(labels, labels + nLabels, NA_INTEGER);
     currentLoc.resize(nDims);
     
     connections.clear();
     SmartGraph::NodeMap<size_t> indexMap(connections);
     std::vector<SmartGraph::Node> nodes(original->size(), INVALID);
     
+    // Which elements are in the foreground, being neither zero nor NA, and
+    // which kernel elements allow connections, are found once up front, so
+    // that values don't have to be tested again for every neighbour
+    std::vector<unsigned char> foreground(nLabels), connects(neighbourhoodSize);
+    for (size_t i=0; i<nLabels; i++)
+    {
+        const DataType &value = original->at(i);
+        foreground[i] = (ElementTraits<DataType>::isNA(value) || value == DataType(0)) ? 0 : 1;
+    }
+    for (size_t k=0; k<neighbourhoodSize; k++)
+        connects[k] = (R_IsNA(kernelArray->at(k)) || kernelArray->at(k) == 0.0) ? 0 : 1;
+    
     // Construct the graph
     for (size_t i=0; i<nLabels; i++)
     {
-        const double &value = original->at(i);
-        if (R_IsNA(value) || value == 0.0)
+        if (!foreground[i])
             continue;
         
         if (nodes[i] == INVALID)
@@ -44,6 +56,9 @@ std::vector<int> & Componenter::run ()
         // only need to look at half of it
         for (size_t k=(neighbourhoodSize/2)+1; k<neighbourhoodSize; k++)
         {
+            if (!connects[k])
+                continue;
+            
             const ptrdiff_t loc = i + sourceNeighbourhood.offsets[k];
             
             // Check if we're out of bounds in any dimension
@@ -58,11 +73,8 @@ std::vector<int> & Componenter::run ()
             if (!validLoc)
                 continue;
             
-            const double &neighbourValue = original->at(loc);
-            const double &kernelValue = kernelArray->at(k);
-            
-            // Zero or NA neighbour or kernel value means no connection
-            if (R_IsNA(neighbourValue) || neighbourValue == 0.0 || R_IsNA(kernelValue) || kernelValue == 0.0)
+            // Zero or NA neighbour means no connection
+            if (!foreground[loc])
                 continue;
             
             // Create a node for the neighbour if there isn't already one
@@ -84,6 +96,10 @@ std::vector<int> & Componenter::run ()
     
     for (SmartGraph::NodeIt node(connections); node != INVALID; ++node)
         labels[indexMap[node]] = componentMemberships[node];
-    
-    return labels;
 }
+
+// Explicit instantiations for each supported element type
+template class Componenter<double>;
+template class Componenter<int>;
+template class Componenter<unsigned char>;
+template class Componenter<float>;
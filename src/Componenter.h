@@ -6,19 +6,20 @@
 
 #include "lemon/smart_graph.h"
 
+// Connected component labelling, templated on the element type of the array
+template <typename DataType>
 class Componenter
 {
 private:
-    Array<double> *original;
+    Array<DataType> *original;
     DiscreteKernel *kernel;
     
     std::vector<int> currentLoc;
     
     lemon::SmartGraph connections;
-    std::vector<int> labels;
     
 public:
-    Componenter (Array<double> * const original, DiscreteKernel * const kernel)
+    Componenter (Array<DataType> * const original, DiscreteKernel * const kernel)
         : original(original), kernel(kernel) {}
     
     ~Componenter ()
@@ -27,7 +28,9 @@ public:
         delete kernel;
     }
     
-    std::vector<int> & run ();
+    // Write component labels into the buffer given, which must have the same
+    // length as the original array
+    void run (int * const labels);
 };
 
 #endif
@@ -3,14 +3,17 @@
 
 #include "Array.h"
 
+// Euclidean distance transform, templated on the element type of the array
+// The distances themselves are always double precision
+template <typename DataType>
 class Distancer
 {
 private:
-    Array<double> *original;
+    Array<DataType> *original;
     bool usePixdim;
     
 public:
-    Distancer (Array<double> * const original, const bool usePixdim)
+    Distancer (Array<DataType> * const original, const bool usePixdim)
         : original(original), usePixdim(usePixdim) {}
     
     ~Distancer ()
@@ -18,7 +21,9 @@ public:
         delete original;
     }
     
-    Array<double> * run ();
+    // Write distances into the buffer given, which must have the same length
+    // as the original array
+    void run (double * const distances);
 };
 
 #endif
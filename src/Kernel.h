@@ -20,6 +20,8 @@ public:
     
     virtual double evaluate (const double x) const { return 0.0; }
     
+    virtual double derivative (const double x) const { return 0.0; }
+    
     double getSupportMin () const { return supportMin; }
     
     double getSupportMax () const { return supportMax; }
@@ -63,95 +65,199 @@ public:
     Array<double> * getArray () const { return values; }
 };
 
+// Compile-time Horner's scheme evaluation of a polynomial of degree N, with
+// coefficients stored in increasing order of power
+// The derivative follows from differentiating p(x) = c0 + x q(x), which gives
+// p'(x) = q(x) + x q'(x)
 template <int N>
 struct PolynomialEvaluator
 {
-private:
-    const Rcpp::NumericVector *coefficients;
-    const PolynomialEvaluator<N-1> child;
-
-public:
-    PolynomialEvaluator (const Rcpp::NumericVector *coefficients)
-        : coefficients(coefficients), child(coefficients) {}
-
-    double operator() (const double x) const { return (*coefficients)[N] + x * child(x); }
+    static inline double evaluate (const double * const coefficients, const double x)
+    {
+        return coefficients[0] + x * PolynomialEvaluator<N-1>::evaluate(coefficients + 1, x);
+    }
+    
+    static inline double derivative (const double * const coefficients, const double x)
+    {
+        return PolynomialEvaluator<N-1>::evaluate(coefficients + 1, x) + x * PolynomialEvaluator<N-1>::derivative(coefficients + 1, x);
+    }
 };
 
 template <>
 struct PolynomialEvaluator<0>
 {
-private:
-    const Rcpp::NumericVector *coefficients;
+    static inline double evaluate (const double * const coefficients, const double x) { return coefficients[0]; }
+    
+    static inline double derivative (const double * const coefficients, const double x) { return 0.0; }
+};
 
-public:
-    PolynomialEvaluator (const Rcpp::NumericVector *coefficients)
-        : coefficients(coefficients) {}
+// All of the kernels below are symmetric functions of |x|, so their
+// derivatives are the derivative with respect to |x|, times the sign of x
+inline double signOf (const double x)
+{
+    return (x > 0.0) ? 1.0 : ((x < 0.0) ? -1.0 : 0.0);
+}
 
-    double operator() (const double x) const { return (*coefficients)[0]; }
-};
+// The kernel classes below are final, and their evaluate() and derivative()
+// methods are defined inline, so that code templated on the specific kernel
+// type (such as the Resampler) can bind and inline them statically
 
 // General polynomial kernel
 // Evaluates to a polynomial function of location, within the support region
 template <int Degree>
-class PolynomialKernel : public Kernel
+class PolynomialKernel final : public Kernel
 {
 protected:
-    Rcpp::NumericVector coefficients;
-    PolynomialEvaluator<Degree> evaluator;
+    double coefficients[Degree+1];
     
 public:
-    PolynomialKernel (const Rcpp::NumericVector &coefficients, const double supportMin, const double supportMax)
-        : Kernel(supportMin,supportMax), coefficients(coefficients), evaluator(&this->coefficients)
+    PolynomialKernel (const double * const coefficients, const double supportMin, const double supportMax)
+        : Kernel(supportMin,supportMax)
+    {
+        std::copy(coefficients, coefficients + Degree + 1, this->coefficients);
+    }
+    
+    double evaluate (const double x) const
     {
-        std::reverse(this->coefficients.begin(), this->coefficients.end());
+        const double absX = fabs(x);
+        return (absX >= supportMin && absX <= supportMax) ? PolynomialEvaluator<Degree>::evaluate(coefficients, absX) : 0.0;
     }
     
-    double evaluate (const double x) const;
+    double derivative (const double x) const
+    {
+        const double absX = fabs(x);
+        return (absX >= supportMin && absX <= supportMax) ? signOf(x) * PolynomialEvaluator<Degree>::derivative(coefficients, absX) : 0.0;
+    }
 };
 
-// Composite kernel
-// A kernel comprised of several other kernels with different supports
-class CompositeKernel : public Kernel
+// Mitchell-Netravali kernel: piecewise cubic, with one polynomial for |x| <= 1
+// and another for 1 < |x| <= 2
+class MitchellNetravaliKernel final : public Kernel
 {
 protected:
-    std::vector<Kernel*> kernels;
+    double innerCoefficients[4], outerCoefficients[4];
     
 public:
-    CompositeKernel (const std::vector<Kernel*> &kernels)
-        : kernels(kernels)
+    MitchellNetravaliKernel (const double B, const double C)
+        : Kernel(0.0, 2.0)
     {
-        supportMin = R_PosInf;
-        supportMax = R_NegInf;
+        innerCoefficients[0] = 1.0 - B/3.0;
+        innerCoefficients[1] = 0.0;
+        innerCoefficients[2] = -3.0 + 2.0*B + C;
+        innerCoefficients[3] = 2.0 - 1.5*B - C;
         
-        for (std::vector<Kernel*>::iterator i = this->kernels.begin(); i != this->kernels.end(); i++)
-        {
-            if ((*i)->getSupportMin() < supportMin)
-                supportMin = (*i)->getSupportMin();
-            if ((*i)->getSupportMax() > supportMax)
-                supportMax = (*i)->getSupportMax();
-        }
+        outerCoefficients[0] = 4.0*B/3.0 + 4.0*C;
+        outerCoefficients[1] = -2.0*B - 8.0*C;
+        outerCoefficients[2] = B + 5.0*C;
+        outerCoefficients[3] = -B/6.0 - C;
     }
     
-    ~CompositeKernel ()
+    double evaluate (const double x) const
     {
-        for (std::vector<Kernel*>::iterator i = this->kernels.begin(); i != this->kernels.end(); i++)
-            delete *i;
+        const double absX = fabs(x);
+        if (absX <= 1.0)
+            return PolynomialEvaluator<3>::evaluate(innerCoefficients, absX);
+        else
+            return (absX <= 2.0) ? PolynomialEvaluator<3>::evaluate(outerCoefficients, absX) : 0.0;
     }
     
-    double evaluate (const double x) const;
+    double derivative (const double x) const
+    {
+        const double absX = fabs(x);
+        if (absX <= 1.0)
+            return signOf(x) * PolynomialEvaluator<3>::derivative(innerCoefficients, absX);
+        else
+            return (absX <= 2.0) ? signOf(x) * PolynomialEvaluator<3>::derivative(outerCoefficients, absX) : 0.0;
+    }
 };
 
-// Lanczos kernel: windowed sinc kernel with three lobes
-class LanczosKernel : public Kernel
+// Lanczos kernel: windowed sinc kernel with a configurable number of lobes
+// Evaluation can optionally use linear interpolation into a precomputed
+// table, which avoids the trigonometric function calls
+class LanczosKernel final : public Kernel
 {
+protected:
+    int lobes;
+    std::vector<double> table, derivativeTable;
+    
+    double calculate (const double x) const
+    {
+        const double absX = fabs(x);
+        if (absX >= lobes)
+            return 0.0;
+        else if (absX == 0.0)
+            return 1.0;
+        else
+            return (lobes * sinpi(absX) * sinpi(absX/lobes)) / (R_pow_di(absX*M_PI, 2));
+    }
+    
+    // Derivative with respect to |x|. Close to zero the exact expression
+    // suffers from cancellation, so a Taylor approximation is used instead
+    double calculateDerivative (const double x) const
+    {
+        const double absX = fabs(x);
+        if (absX >= lobes)
+            return 0.0;
+        else if (absX < 1.0e-4)
+            return -(M_PI * M_PI / 3.0) * (1.0 + 1.0 / (lobes * lobes)) * absX;
+        else
+        {
+            const double numeratorDerivative = M_PI * (lobes * cospi(absX) * sinpi(absX/lobes) + sinpi(absX) * cospi(absX/lobes));
+            return numeratorDerivative / R_pow_di(absX*M_PI, 2) - 2.0 * calculate(absX) / absX;
+        }
+    }
+    
+    double interpolate (const std::vector<double> &values, const double absX) const
+    {
+        const double loc = absX * tableResolution;
+        const size_t index = static_cast<size_t>(loc);
+        return values[index] + (loc - static_cast<double>(index)) * (values[index+1] - values[index]);
+    }
+    
 public:
-    LanczosKernel ()
+    // Number of table entries per unit distance from the origin
+    static const int tableResolution = 1024;
+    
+    LanczosKernel (const int lobes = 3, const bool tabulate = false)
+        : Kernel(0.0, static_cast<double>(lobes)), lobes(lobes)
     {
-        supportMin = -3.0;
-        supportMax = 3.0;
+        if (tabulate)
+        {
+            // One extra entry is needed so that interpolation at the edge of
+            // the support stays within the table
+            table.resize(lobes * tableResolution + 2);
+            derivativeTable.resize(lobes * tableResolution + 2);
+            for (size_t i=0; i<table.size(); i++)
+            {
+                table[i] = calculate(static_cast<double>(i) / tableResolution);
+                derivativeTable[i] = calculateDerivative(static_cast<double>(i) / tableResolution);
+            }
+        }
     }
     
-    double evaluate (const double x) const;
+    int getLobes () const { return lobes; }
+    
+    double evaluate (const double x) const
+    {
+        const double absX = fabs(x);
+        if (absX > supportMax)
+            return 0.0;
+        else if (table.empty())
+            return calculate(absX);
+        else
+            return interpolate(table, absX);
+    }
+    
+    double derivative (const double x) const
+    {
+        const double absX = fabs(x);
+        if (absX > supportMax)
+            return 0.0;
+        else if (derivativeTable.empty())
+            return signOf(x) * calculateDerivative(absX);
+        else
+            return signOf(x) * interpolate(derivativeTable, absX);
+    }
 };
 
 // Kernel generator
@@ -161,8 +267,8 @@ class KernelGenerator
 public:
     static PolynomialKernel<0> * box ();
     static PolynomialKernel<1> * triangle ();
-    static CompositeKernel * mitchellNetravali (const double B, const double C);
-    static LanczosKernel * lanczos ();
+    static MitchellNetravaliKernel * mitchellNetravali (const double B, const double C);
+    static LanczosKernel * lanczos (const int lobes = 3, const bool tabulate = false);
 };
 
 #endif
@@ -0,0 +1,84 @@
+#include <Rcpp.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "MappedFile.h"
+
+#ifdef _WIN32
+
+MappedFile::MappedFile (const std::string &path, const size_t offset, const size_t length, const Mode mode)
+    : base(NULL), mappedLength(0), delta(0), length(length), mode(mode)
+{
+    throw std::runtime_error("Memory-mapped files are not supported on this platform");
+}
+
+MappedFile::~MappedFile () {}
+
+void MappedFile::reserve (const std::string &path, const size_t size)
+{
+    throw std::runtime_error("Memory-mapped files are not supported on this platform");
+}
+
+#else
+
+MappedFile::MappedFile (const std::string &path, const size_t offset, const size_t length, const Mode mode)
+    : base(NULL), mappedLength(0), delta(0), length(length), mode(mode)
+{
+    const int fd = open(path.c_str(), mode == ReadWrite ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Can't open file " + path);
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < offset + length)
+    {
+        close(fd);
+        throw std::runtime_error("File " + path + " is too short to contain the specified data");
+    }
+    
+    // The mapping itself has to start on a page boundary
+    const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    delta = offset % pageSize;
+    mappedLength = length + delta;
+    
+    // Zero-length mappings aren't allowed, but there's nothing to read anyway
+    if (mappedLength > 0)
+    {
+        const int protection = (mode == ReadOnly ? PROT_READ : (PROT_READ | PROT_WRITE));
+        base = mmap(NULL, mappedLength, protection, mode == CopyOnWrite ? MAP_PRIVATE : MAP_SHARED, fd, offset - delta);
+        if (base == MAP_FAILED)
+        {
+            base = NULL;
+            close(fd);
+            throw std::runtime_error("Can't map file " + path + " into memory");
+        }
+    }
+    
+    // The mapping remains valid after the file is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile ()
+{
+    if (base != NULL)
+        munmap(base, mappedLength);
+}
+
+void MappedFile::reserve (const std::string &path, const size_t size)
+{
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Can't create file " + path);
+    
+    struct stat info;
+    const bool ok = (fstat(fd, &info) == 0 && (size_t(info.st_size) >= size || ftruncate(fd, off_t(size)) == 0));
+    close(fd);
+    if (!ok)
+        throw std::runtime_error("Can't extend file " + path);
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef _MAPPED_FILE_H_
+#define _MAPPED_FILE_H_
+
+#include <string>
+
+// A region of a file mapped into memory, starting at an arbitrary byte offset
+// within it. Pages are read from the file only when they are first touched,
+// and in read-write mode changes are written back to it by the operating
+// system, so arrays much larger than the available memory can be processed
+// through a mapping. In copy-on-write mode the mapping can be modified, but
+// changes are private to it and never reach the file. The region is unmapped
+// when the object is destroyed
+class MappedFile
+{
+public:
+    enum Mode { ReadOnly, ReadWrite, CopyOnWrite };
+    
+private:
+    void *base;
+    size_t mappedLength, delta, length;
+    Mode mode;
+    
+    // Mappings can't be shared, so copying is not allowed
+    MappedFile (const MappedFile &);
+    MappedFile & operator= (const MappedFile &);
+    
+public:
+    MappedFile (const std::string &path, const size_t offset, const size_t length, const Mode mode = ReadOnly);
+    
+    ~MappedFile ();
+    
+    size_t size () const { return length; }
+    Mode getMode () const { return mode; }
+    
+    void * data () const { return static_cast<char *>(base) + delta; }
+    
+    // Create a file, or extend an existing one, so that it is at least the
+    // specified number of bytes in length
+    static void reserve (const std::string &path, const size_t size);
+};
+
+#endif
@@ -1,11 +1,290 @@
 #include <Rcpp.h>
 
+#include <limits>
+
 #include "Morpher.h"
+#include "Parallel.h"
 
-bool Morpher::meetsRestrictions (const size_t n)
+// Replace each value with the sum of values within a box around it, with the
+// specified radius along each dimension, or with 1 if that sum is nonzero and
+// "any" is true. The box is separable, so this is a running sum along each
+// dimension in turn, which is updated a whole row of adjacent elements at a
+// time. Beyond the edges there is nothing to add
+template <typename ValueType>
+static void boxSum (std::vector<ValueType> &values, const int_vector &dims, const std::vector<size_t> &strides, const int_vector &radii, const bool any = false)
 {
-    double value = original->at(n);
+    const size_t nSamples = values.size();
+    std::vector<ValueType> original;
+    int_vector sums;
+    for (size_t j=0; j<dims.size(); j++)
+    {
+        const size_t stride = strides[j];
+        const int length = dims[j];
+        const int radius = radii[j];
+        if (length < 2 || radius < 1)
+            continue;
+        
+        original = values;
+        sums.resize(stride);
+        const size_t nBlocks = nSamples / (stride * length);
+        
+        // Along the first dimension the rows are single elements, so a scalar
+        // sum is much cheaper
+        if (stride == 1)
+        {
+            for (size_t b=0; b<nBlocks; b++)
+            {
+                const ValueType * const in = &original[b * length];
+                ValueType * const out = &values[b * length];
+                int sum = 0;
+                for (int t=0; t<std::min(radius,length-1)+1; t++)
+                    sum += in[t];
+                for (int t=0; t<length; t++)
+                {
+                    out[t] = (any ? (sum > 0 ? 1 : 0) : sum);
+                    if (t + radius + 1 < length)
+                        sum += in[t + radius + 1];
+                    if (t - radius >= 0)
+                        sum -= in[t - radius];
+                }
+            }
+            continue;
+        }
+        
+        for (size_t b=0; b<nBlocks; b++)
+        {
+            const ValueType * const in = &original[b * stride * length];
+            ValueType * const out = &values[b * stride * length];
+            
+            std::fill(sums.begin(), sums.end(), 0);
+            for (int t=0; t<std::min(radius,length-1)+1; t++)
+            {
+                for (size_t l=0; l<stride; l++)
+                    sums[l] += in[t * stride + l];
+            }
+            
+            for (int t=0; t<length; t++)
+            {
+                if (any)
+                {
+                    for (size_t l=0; l<stride; l++)
+                        out[t * stride + l] = (sums[l] > 0 ? 1 : 0);
+                }
+                else
+                {
+                    for (size_t l=0; l<stride; l++)
+                        out[t * stride + l] = sums[l];
+                }
+                
+                if (t + radius + 1 < length)
+                {
+                    for (size_t l=0; l<stride; l++)
+                        sums[l] += in[(t + radius + 1) * stride + l];
+                }
+                if (t - radius >= 0)
+                {
+                    for (size_t l=0; l<stride; l++)
+                        sums[l] -= in[(t - radius) * stride + l];
+                }
+            }
+        }
+    }
+}
+
+// Replace each value with the sum, minimum or maximum of the values within a
+// box around it, working along one dimension at a time as in boxSum(), but in
+// double precision. Sums are kept running along each row, while extremes are
+// found by scanning the part of the row within the box, which is still much
+// cheaper than visiting the whole box for every element
+enum BoxReduction { BoxSum, BoxMin, BoxMax };
+
+static void boxReduce (double * const values, const size_t nSamples, const int_vector &dims, const std::vector<size_t> &strides, const int_vector &radii, const BoxReduction reduction)
+{
+    dbl_vector original, sums;
+    for (size_t j=0; j<dims.size(); j++)
+    {
+        const size_t stride = strides[j];
+        const int length = dims[j];
+        const int radius = radii[j];
+        if (length < 2 || radius < 1)
+            continue;
+        
+        original.assign(values, values + nSamples);
+        const size_t nBlocks = nSamples / (stride * length);
+        
+        for (size_t b=0; b<nBlocks; b++)
+        {
+            const double * const in = &original[b * stride * length];
+            double * const out = &values[b * stride * length];
+            
+            if (reduction == BoxSum)
+            {
+                sums.assign(stride, 0.0);
+                for (int t=0; t<std::min(radius,length-1)+1; t++)
+                {
+                    for (size_t l=0; l<stride; l++)
+                        sums[l] += in[t * stride + l];
+                }
+                
+                for (int t=0; t<length; t++)
+                {
+                    for (size_t l=0; l<stride; l++)
+                        out[t * stride + l] = sums[l];
+                    if (t + radius + 1 < length)
+                    {
+                        for (size_t l=0; l<stride; l++)
+                            sums[l] += in[(t + radius + 1) * stride + l];
+                    }
+                    if (t - radius >= 0)
+                    {
+                        for (size_t l=0; l<stride; l++)
+                            sums[l] -= in[(t - radius) * stride + l];
+                    }
+                }
+            }
+            else
+            {
+                for (int t=0; t<length; t++)
+                {
+                    const int first = std::max(0, t - radius);
+                    const int last = std::min(length - 1, t + radius);
+                    double * const row = out + t * stride;
+                    for (size_t l=0; l<stride; l++)
+                        row[l] = in[first * stride + l];
+                    for (int u=first+1; u<=last; u++)
+                    {
+                        const double * const other = in + u * stride;
+                        if (reduction == BoxMin)
+                        {
+                            for (size_t l=0; l<stride; l++)
+                                row[l] = std::min(row[l], other[l]);
+                        }
+                        else
+                        {
+                            for (size_t l=0; l<stride; l++)
+                                row[l] = std::max(row[l], other[l]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <typename DataType>
+void Morpher<DataType>::countNeighbours (const Array<DataType> &source, int_vector &counts) const
+{
+    const size_t nSamples = source.size();
+    counts.resize(nSamples);
+    for (size_t i=0; i<nSamples; i++)
+        counts[i] = (source.at(i) != DataType(0)) ? 1 : 0;
+    
+    // The immediate neighbourhood is a cube of width 3, so the count over it
+    // is a box sum, less the element itself
+    boxSum(counts, source.getDimensions(), source.getStrides(), int_vector(source.getDimensionality(), 1));
+    for (size_t i=0; i<nSamples; i++)
+    {
+        if (source.at(i) != DataType(0))
+            counts[i]--;
+    }
+}
+
+template <typename DataType>
+bool Morpher<DataType>::findActiveElements (const Array<DataType> &source, const NeighbourhoodTable &sourceNeighbourhood, Workspace &workspace) const
+{
+    // Only selective operations which pass original values through are
+    // eligible, and the kernel must include the element itself, so that a
+    // neighbourhood of equal values reproduces that value
+    const Array<double> *kernelArray = kernel->getArray();
+    const size_t centre = (sourceNeighbourhood.size - 1) / 2;
+    if (elementOp != IdentityOp || !(mergeOp == MinOp || mergeOp == MaxOp || mergeOp == AllOp || mergeOp == AnyOp))
+        return false;
+    if (sourceNeighbourhood.size == 0 || R_IsNA(kernelArray->at(centre)) || kernelArray->at(centre) == 0.0)
+        return false;
+    
+    // The array must also be binary. Boundary elements are those with an
+    // immediate neighbour of the other value, so that there is both a zero
+    // and a one in the box around them
+    const size_t nSamples = source.size();
+    const int_vector &dims = source.getDimensions();
+    const std::vector<size_t> &strides = source.getStrides();
+    const int nDims = source.getDimensionality();
+    size_t nOnes = 0;
+    for (size_t i=0; i<nSamples; i++)
+    {
+        const double value = ElementTraits<DataType>::toDouble(source[i]);
+        if (value != 0.0 && value != 1.0)
+            return false;
+        else if (value == 1.0)
+            nOnes++;
+    }
+    
+    // If value restrictions already rule out most elements, as when eroding
+    // a sparse mask, finding the active ones would cost more than it saves
+    const size_t nAdmitted = (meetsValueRestrictions(0.0) ? nSamples - nOnes : 0) + (meetsValueRestrictions(1.0) ? nOnes : 0);
+    if (nAdmitted < nSamples / 8)
+        return false;
+    
+    std::vector<unsigned char> ones(nSamples), zeroes(nSamples);
+    for (size_t i=0; i<nSamples; i++)
+    {
+        ones[i] = (source[i] != DataType(0)) ? 1 : 0;
+        zeroes[i] = 1 - ones[i];
+    }
+    boxSum(ones, dims, strides, int_vector(nDims, 1), true);
+    boxSum(zeroes, dims, strides, int_vector(nDims, 1), true);
+    for (size_t i=0; i<nSamples; i++)
+        ones[i] &= zeroes[i];
+    
+    // Any two elements of different values within the bounding box of the
+    // kernel imply a boundary element between them, so elements with no
+    // boundary element in that box see only their own value, and are
+    // unchanged. The rest are active
+    int_vector radii(nDims, 0);
+    for (size_t k=0; k<sourceNeighbourhood.size; k++)
+    {
+        for (int j=0; j<nDims; j++)
+            radii[j] = std::max(radii[j], std::abs(sourceNeighbourhood.loc(k,j)));
+    }
+    boxSum(ones, dims, strides, radii, true);
+    
+    workspace.active.clear();
+    for (size_t i=0; i<nSamples; i++)
+    {
+        if (ones[i])
+            workspace.active.push_back(i);
+    }
+    
+    return true;
+}
+
+template <typename DataType>
+void Morpher<DataType>::findValidCounts (const int nDims, std::vector<bool> &valid) const
+{
+    size_t nCounts = 1;
+    for (int j=0; j<nDims; j++)
+        nCounts *= 3;
     
+    // Counts outside the possible range can never match, so they are ignored
+    valid.assign(nCounts, includedNeighbourhoods.size() == 0);
+    for (size_t i=0; i<includedNeighbourhoods.size(); i++)
+    {
+        if (includedNeighbourhoods[i] >= 0 && size_t(includedNeighbourhoods[i]) < nCounts)
+            valid[includedNeighbourhoods[i]] = true;
+    }
+    if (includedNeighbourhoods.size() == 0)
+    {
+        for (size_t i=0; i<excludedNeighbourhoods.size(); i++)
+        {
+            if (excludedNeighbourhoods[i] >= 0 && size_t(excludedNeighbourhoods[i]) < nCounts)
+                valid[excludedNeighbourhoods[i]] = false;
+        }
+    }
+}
+
+template <typename DataType>
+bool Morpher<DataType>::meetsValueRestrictions (const double value) const
+{
     if (includedValues.size() > 0)
     {
         bool found = false;
@@ -27,57 +306,23 @@ bool Morpher::meetsRestrictions (const size_t n)
         }
     }
     
-    if (includedNeighbourhoods.size() > 0 || excludedNeighbourhoods.size() > 0)
-    {
-        int nDims = original->getDimensionality();
-        original->expandIndex(n, currentLoc);
-        const std::vector<int> &dims = original->getDimensions();
-        
-        int nNeighbours = 0;
-        size_t neighbourhoodCentre = (immediateNeighbourhood.size - 1) / 2;
-        for (size_t k=0; k<immediateNeighbourhood.size; k++)
-        {
-            if (k == neighbourhoodCentre)
-                continue;
-            
-            bool validLoc = true;
-            for (int j=0; j<nDims; j++)
-            {
-                int currentDimIndex = currentLoc[j] + immediateNeighbourhood.locs(k,j);
-                if (currentDimIndex < 0 || currentDimIndex >= dims[j])
-                    validLoc = false;
-            }
-            
-            if (validLoc && original->at(n+immediateNeighbourhood.offsets[k]) != 0.0)
-                nNeighbours++;
-        }
-        
-        if (includedNeighbourhoods.size() > 0)
-        {
-            bool found = false;
-            for (size_t i=0; i<includedNeighbourhoods.size(); i++)
-            {
-                if (nNeighbours == includedNeighbourhoods[i])
-                    found = true;
-            }
-        
-            if (!found)
-                return false;
-        }
-        else if (excludedNeighbourhoods.size() > 0)
-        {
-            for (size_t i=0; i<excludedNeighbourhoods.size(); i++)
-            {
-                if (nNeighbours == excludedNeighbourhoods[i])
-                    return false;
-            }
-        }
-    }
+    return true;
+}
+
+template <typename DataType>
+bool Morpher<DataType>::meetsRestrictions (const Array<DataType> &source, const size_t n, const Workspace &workspace) const
+{
+    if (!meetsValueRestrictions(ElementTraits<DataType>::toDouble(source.at(n))))
+        return false;
+    
+    if (hasNeighbourhoodRestrictions())
+        return workspace.validCounts[workspace.counts[n]];
     
     return true;
 }
 
-void Morpher::resetValues ()
+template <typename DataType>
+void Morpher<DataType>::resetValues (dbl_vector &values) const
 {
     values.clear();
     if (mergeOp == MinOp)
@@ -90,7 +335,8 @@ void Morpher::resetValues ()
         values.push_back(0.0);
 }
 
-void Morpher::accumulateValue (double value)
+template <typename DataType>
+void Morpher<DataType>::accumulateValue (dbl_vector &values, double value) const
 {
     if (R_IsNA(value))
         return;
@@ -107,7 +353,29 @@ void Morpher::accumulateValue (double value)
         values.push_back(value);
 }
 
-double Morpher::mergeValues ()
+// The sample quantile of a set of values, interpolating between order
+// statistics in the same way as R's quantile() function with its default
+// type 7. Only the order statistics needed are found, not a full sort
+static double quantileOf (dbl_vector &values, const double probability)
+{
+    const size_t n = values.size();
+    const double position = (n - 1) * probability;
+    const size_t lowerIndex = static_cast<size_t>(floor(position));
+    const double fraction = position - lowerIndex;
+    
+    std::nth_element(values.begin(), values.begin() + lowerIndex, values.end());
+    const double lowerValue = values[lowerIndex];
+    if (fraction == 0.0 || lowerIndex + 1 >= n)
+        return lowerValue;
+    
+    // Everything above the lower index is at least as large, so the next
+    // order statistic is the smallest of those values
+    const double upperValue = *std::min_element(values.begin() + lowerIndex + 1, values.end());
+    return ((1.0 - fraction) * lowerValue + fraction * upperValue);
+}
+
+template <typename DataType>
+double Morpher<DataType>::mergeValues (dbl_vector &values) const
 {
     if (values.size() == 0)
         return NA_REAL;
@@ -134,14 +402,10 @@ double Morpher::mergeValues ()
             }
             
             case MedianOp:
-            {
-                int middleIndex = values.size() / 2;
-                std::partial_sort(values.begin(), values.begin()+middleIndex+1, values.end());
-                if (values.size() % 2 == 0)
-                    return ((values[middleIndex-1] + values[middleIndex]) / 2.0);
-                else
-                    return values[middleIndex];
-            }
+            return quantileOf(values, 0.5);
+            
+            case RankOp:
+            return quantileOf(values, quantile);
             
             default:
             return NA_REAL;
@@ -151,18 +415,419 @@ double Morpher::mergeValues ()
     return NA_REAL;
 }
 
-std::vector<double> & Morpher::run ()
+// A histogram of integer values within a sliding window. A current bin is
+// kept, along with the number of values below it, so that an order statistic
+// close to the last one found can be located in a few steps
+class SlidingHistogram
 {
-    Array<double> * kernelArray = kernel->getArray();
-    const Neighbourhood &kernelNeighbourhood = kernelArray->getNeighbourhood();
-    const Neighbourhood &sourceNeighbourhood = original->getNeighbourhood(kernelArray->getDimensions());
-    const size_t neighbourhoodSize = kernelNeighbourhood.size;
+private:
+    int_vector counts;
+    size_t total, bin, below;
     
-    const int_vector &dims = original->getDimensions();
-    int nDims = original->getDimensionality();
-    const size_t nSamples = original->size();
-    samples.resize(nSamples);
-    currentLoc.resize(nDims);
+public:
+    SlidingHistogram (const size_t nBins)
+        : counts(nBins, 0), total(0), bin(0), below(0) {}
+    
+    size_t size () const { return total; }
+    
+    void add (const size_t value)
+    {
+        counts[value]++;
+        total++;
+        if (value < bin)
+            below++;
+    }
+    
+    void remove (const size_t value)
+    {
+        counts[value]--;
+        total--;
+        if (value < bin)
+            below--;
+    }
+    
+    // Find the bin containing the order statistic with the given zero-based
+    // index, and optionally the one after it
+    size_t find (const size_t index)
+    {
+        while (below > index)
+        {
+            bin--;
+            below -= counts[bin];
+        }
+        while (below + counts[bin] <= index)
+        {
+            below += counts[bin];
+            bin++;
+        }
+        return bin;
+    }
+    
+    size_t findNext (const size_t index)
+    {
+        size_t next = find(index);
+        if (below + counts[next] > index + 1)
+            return next;
+        
+        next++;
+        while (counts[next] == 0)
+            next++;
+        return next;
+    }
+};
+
+// Find the histogram bin of the value under kernel element k, when the kernel
+// is centred at position t along a line, if it is within the array and not NA
+template <typename DataType>
+static bool windowBin (const Array<DataType> &source, const NeighbourhoodTable &neighbourhood, const std::vector<bool> &rowValid, const size_t start, const int t, const size_t k, const double minValue, size_t &bin)
+{
+    const int position = t + neighbourhood.loc(k,0);
+    if (!rowValid[k] || position < 0 || position >= source.getDimensions()[0])
+        return false;
+    
+    const DataType value = source[start + t + neighbourhood.offsets[k]];
+    if (ElementTraits<DataType>::isNA(value))
+        return false;
+    
+    bin = static_cast<size_t>(ElementTraits<DataType>::toDouble(value) - minValue);
+    return true;
+}
+
+template <typename DataType> template <typename OutputType>
+bool Morpher<DataType>::rankByHistogram (const Array<DataType> &source, const NeighbourhoodTable &sourceNeighbourhood, OutputType * const result, Workspace &workspace) const
+{
+    if (!std::numeric_limits<DataType>::is_integer || source.empty())
+        return false;
+    
+    // The histogram covers the range of values in the array, which must be
+    // modest for the bins to be cheap to maintain
+    const size_t nSamples = source.size();
+    double minValue = R_PosInf, maxValue = R_NegInf;
+    for (size_t i=0; i<nSamples; i++)
+    {
+        if (!ElementTraits<DataType>::isNA(source[i]))
+        {
+            minValue = std::min(minValue, ElementTraits<DataType>::toDouble(source[i]));
+            maxValue = std::max(maxValue, ElementTraits<DataType>::toDouble(source[i]));
+        }
+    }
+    if (!R_FINITE(minValue) || maxValue - minValue >= 65536.0)
+        return false;
+    
+    // The footprint is the set of kernel elements whose values are counted.
+    // Moving one element along a line, those with no footprint element
+    // immediately before them leave the window, and those with none
+    // immediately after them enter it
+    const Array<double> *kernelArray = kernel->getArray();
+    const size_t neighbourhoodSize = sourceNeighbourhood.size;
+    std::vector<bool> inFootprint(neighbourhoodSize);
+    int minOffset = 0, maxOffset = 0;
+    for (size_t k=0; k<neighbourhoodSize; k++)
+    {
+        inFootprint[k] = (!R_IsNA(kernelArray->at(k)) && kernelArray->at(k) != 0.0);
+        minOffset = std::min(minOffset, sourceNeighbourhood.loc(k,0));
+        maxOffset = std::max(maxOffset, sourceNeighbourhood.loc(k,0));
+    }
+    
+    std::vector<size_t> footprint, leaving, entering;
+    for (size_t k=0; k<neighbourhoodSize; k++)
+    {
+        if (!inFootprint[k])
+            continue;
+        footprint.push_back(k);
+        if (sourceNeighbourhood.loc(k,0) == minOffset || !inFootprint[k-1])
+            leaving.push_back(k);
+        if (sourceNeighbourhood.loc(k,0) == maxOffset || !inFootprint[k+1])
+            entering.push_back(k);
+    }
+    
+    const int_vector &dims = source.getDimensions();
+    const int nDims = source.getDimensionality();
+    const int length = dims[0];
+    const size_t nLines = nSamples / length;
+    const double probability = (mergeOp == MedianOp ? 0.5 : quantile);
+    SlidingHistogram histogram(static_cast<size_t>(maxValue - minValue) + 1);
+    std::vector<bool> rowValid(neighbourhoodSize);
+    size_t bin;
+    
+    for (size_t l=0; l<nLines; l++)
+    {
+        const size_t start = l * length;
+        source.expandIndex(start, workspace.loc);
+        
+        // Whether each kernel element falls within the array along the other
+        // dimensions is fixed for the whole line
+        for (size_t k=0; k<neighbourhoodSize; k++)
+        {
+            bool valid = true;
+            for (int j=1; j<nDims; j++)
+            {
+                const int index = workspace.loc[j] + sourceNeighbourhood.loc(k,j);
+                if (index < 0 || index >= dims[j])
+                    valid = false;
+            }
+            rowValid[k] = valid;
+        }
+        
+        for (size_t f=0; f<footprint.size(); f++)
+        {
+            if (windowBin(source, sourceNeighbourhood, rowValid, start, 0, footprint[f], minValue, bin))
+                histogram.add(bin);
+        }
+        
+        for (int t=0; t<length; t++)
+        {
+            if (t > 0)
+            {
+                for (size_t f=0; f<leaving.size(); f++)
+                {
+                    if (windowBin(source, sourceNeighbourhood, rowValid, start, t-1, leaving[f], minValue, bin))
+                        histogram.remove(bin);
+                }
+                for (size_t f=0; f<entering.size(); f++)
+                {
+                    if (windowBin(source, sourceNeighbourhood, rowValid, start, t, entering[f], minValue, bin))
+                        histogram.add(bin);
+                }
+            }
+            
+            const size_t i = start + t;
+            if (!meetsRestrictions(source, i, workspace))
+            {
+                result[i] = ElementTraits<OutputType>::fromDouble(ElementTraits<DataType>::toDouble(source[i]));
+                continue;
+            }
+            else if (histogram.size() == 0)
+            {
+                result[i] = ElementTraits<OutputType>::fromDouble(NA_REAL);
+                continue;
+            }
+            
+            // Interpolate between order statistics as in quantileOf()
+            const double position = (histogram.size() - 1) * probability;
+            const size_t lowerIndex = static_cast<size_t>(floor(position));
+            const double fraction = position - lowerIndex;
+            double value = histogram.find(lowerIndex) + minValue;
+            if (fraction > 0.0 && lowerIndex + 1 < histogram.size())
+                value = (1.0 - fraction) * value + fraction * (histogram.findNext(lowerIndex) + minValue);
+            result[i] = ElementTraits<OutputType>::fromDouble(value);
+        }
+        
+        // Empty the histogram again, ready for the next line
+        for (size_t f=0; f<footprint.size(); f++)
+        {
+            if (windowBin(source, sourceNeighbourhood, rowValid, start, length-1, footprint[f], minValue, bin))
+                histogram.remove(bin);
+        }
+    }
+    
+    return true;
+}
+
+// Combine one kernel element with a run of consecutive elements along a
+// line, merging each result into the corresponding accumulator. The
+// operations are fixed at compile time, so the loop has no branches and can
+// be vectorised. If there are missing values, a validity mask is given, and
+// the accumulators are only updated where it is nonzero
+typedef void (*TapFunction) (double * const, const double * const, const unsigned char * const, const double, const int);
+
+template <ElementOp E, MergeOp M>
+static inline double applyTap (const double accumulator, const double value, const double weight)
+{
+    const double result = (E == PlusOp ? value + weight : (E == MinusOp ? value - weight : (E == MultiplyOp ? value * weight : value)));
+    return (M == MinOp ? std::min(accumulator, result) : (M == MaxOp ? std::max(accumulator, result) : accumulator + result));
+}
+
+template <ElementOp E, MergeOp M>
+static void accumulateTap (double * const accumulators, const double * const values, const unsigned char * const valid, const double weight, const int n)
+{
+    if (valid == NULL)
+    {
+        SIMD_LOOP
+        for (int t=0; t<n; t++)
+            accumulators[t] = applyTap<E,M>(accumulators[t], values[t], weight);
+    }
+    else
+    {
+        SIMD_LOOP
+        for (int t=0; t<n; t++)
+        {
+            const double updated = applyTap<E,M>(accumulators[t], values[t], weight);
+            accumulators[t] = valid[t] ? updated : accumulators[t];
+        }
+    }
+}
+
+template <MergeOp M>
+static TapFunction tapFunction (const ElementOp elementOp)
+{
+    switch (elementOp)
+    {
+        case PlusOp:        return &accumulateTap<PlusOp,M>;
+        case MinusOp:       return &accumulateTap<MinusOp,M>;
+        case MultiplyOp:    return &accumulateTap<MultiplyOp,M>;
+        case IdentityOp:    return &accumulateTap<IdentityOp,M>;
+        default:            return NULL;
+    }
+}
+
+static TapFunction tapFunction (const ElementOp elementOp, const MergeOp mergeOp)
+{
+    switch (mergeOp)
+    {
+        case SumOp:
+        case MeanOp:        return tapFunction<SumOp>(elementOp);
+        case MinOp:         return tapFunction<MinOp>(elementOp);
+        case MaxOp:         return tapFunction<MaxOp>(elementOp);
+        default:            return NULL;
+    }
+}
+
+// The data of an array in double precision, converted if necessary
+template <typename DataType>
+static const double * doubleData (const Array<DataType> &source, dbl_vector &converted)
+{
+    converted.resize(source.size());
+    for (size_t i=0; i<source.size(); i++)
+        converted[i] = ElementTraits<DataType>::toDouble(source[i]);
+    return &converted.front();
+}
+
+static const double * doubleData (const Array<double> &source, dbl_vector &)
+{
+    return &source[0];
+}
+
+template <typename DataType> template <typename OutputType>
+bool Morpher<DataType>::runByLines (const Array<DataType> &source, const NeighbourhoodTable &sourceNeighbourhood, OutputType * const result, Workspace &workspace) const
+{
+    const TapFunction accumulate = tapFunction(elementOp, mergeOp);
+    if (accumulate == NULL || source.empty())
+        return false;
+    
+    // The array is scanned once for missing values. If there are any, a mask
+    // marks the valid elements, so that they can be skipped without testing
+    // each value as it is visited
+    const size_t nSamples = source.size();
+    dbl_vector converted;
+    const double * const data = doubleData(source, converted);
+    std::vector<unsigned char> mask;
+    for (size_t i=0; i<nSamples; i++)
+    {
+        if (R_IsNA(data[i]))
+        {
+            mask.resize(nSamples);
+            for (size_t j=0; j<nSamples; j++)
+                mask[j] = R_IsNA(data[j]) ? 0 : 1;
+            break;
+        }
+    }
+    const unsigned char * const valid = mask.empty() ? NULL : &mask.front();
+    
+    const Array<double> *kernelArray = kernel->getArray();
+    const size_t neighbourhoodSize = sourceNeighbourhood.size;
+    const int_vector &dims = source.getDimensions();
+    const int nDims = source.getDimensionality();
+    const int length = dims[0];
+    const size_t nLines = nSamples / length;
+    const bool sum = (mergeOp == SumOp || mergeOp == MeanOp);
+    const double initial = (mergeOp == MinOp ? R_PosInf : (mergeOp == MaxOp ? R_NegInf : 0.0));
+    
+    double kernelSum = 0.0;
+    if (renormalise && mergeOp == SumOp)
+    {
+        for (size_t k=0; k<neighbourhoodSize; k++)
+            kernelSum += kernelArray->at(k);
+    }
+    
+    // Each kernel element is applied to the whole of a line at once, visiting
+    // the elements in the same order as the general case, so the results are
+    // identical. The counts and visited kernel sums depend only on which part
+    // of the line the element overlaps
+    dbl_vector accumulators(length), visitedKernelSums(length);
+    int_vector counts(length);
+    for (size_t l=0; l<nLines; l++)
+    {
+        const size_t start = l * length;
+        source.expandIndex(start, workspace.loc);
+        std::fill(accumulators.begin(), accumulators.end(), initial);
+        std::fill(visitedKernelSums.begin(), visitedKernelSums.end(), 0.0);
+        std::fill(counts.begin(), counts.end(), 0);
+        
+        for (size_t k=0; k<neighbourhoodSize; k++)
+        {
+            const double weight = kernelArray->at(k);
+            if (R_IsNA(weight) || (elementOp == IdentityOp && weight == 0.0))
+                continue;
+            
+            bool validLoc = true;
+            for (int j=1; j<nDims; j++)
+            {
+                const int index = workspace.loc[j] + sourceNeighbourhood.loc(k,j);
+                if (index < 0 || index >= dims[j])
+                    validLoc = false;
+            }
+            
+            const int offset = sourceNeighbourhood.loc(k,0);
+            const int first = std::max(0, -offset);
+            const int last = std::min(length, length - offset);
+            if (!validLoc || first >= last)
+                continue;
+            
+            const ptrdiff_t from = start + first + sourceNeighbourhood.offsets[k];
+            accumulate(&accumulators[first], data + from, valid == NULL ? NULL : valid + from, weight, last - first);
+            
+            // Missing values are not counted, but their kernel weights are
+            // still included in the visited sum, as in the general case
+            if (sum)
+            {
+                for (int t=first; t<last; t++)
+                {
+                    counts[t] += (valid == NULL ? 1 : valid[from + t - first]);
+                    visitedKernelSums[t] += weight;
+                }
+            }
+        }
+        
+        for (int t=0; t<length; t++)
+        {
+            const size_t i = start + t;
+            if (!meetsRestrictions(source, i, workspace))
+            {
+                result[i] = ElementTraits<OutputType>::fromDouble(data[i]);
+                continue;
+            }
+            
+            double value = accumulators[t];
+            if (sum && counts[t] == 0)
+                value = NA_REAL;
+            else if (mergeOp == MeanOp)
+                value /= static_cast<double>(counts[t]);
+            else if (renormalise && mergeOp == SumOp)
+            {
+                if (kernelSum != 0.0)
+                    value *= kernelSum;
+                if (visitedKernelSums[t] != 0.0)
+                    value /= visitedKernelSums[t];
+            }
+            result[i] = ElementTraits<OutputType>::fromDouble(value);
+        }
+    }
+    
+    return true;
+}
+
+template <typename DataType> template <typename OutputType>
+void Morpher<DataType>::runOn (const Array<DataType> &source, const NeighbourhoodTable &sourceNeighbourhood, OutputType * const result, Workspace &workspace) const
+{
+    const Array<double> * kernelArray = kernel->getArray();
+    const size_t neighbourhoodSize = sourceNeighbourhood.size;
+    
+    const int_vector &dims = source.getDimensions();
+    int nDims = source.getDimensionality();
+    const size_t nSamples = source.size();
+    workspace.loc.resize(nDims);
+    dbl_vector &values = workspace.values;
     
     double kernelSum = 0.0;
     double visitedKernelSum;
@@ -173,16 +838,40 @@ std::vector<double> & Morpher::run ()
             kernelSum += kernelArray->at(k);
     }
     
-    for (size_t i=0; i<nSamples; i++)
+    // Where possible, only elements whose value can change are visited, and
+    // the rest are copied from the source
+    const bool sparse = findActiveElements(source, sourceNeighbourhood, workspace);
+    const size_t nVisited = sparse ? workspace.active.size() : nSamples;
+    if (sparse)
     {
-        if (!meetsRestrictions(i))
+        for (size_t i=0; i<nSamples; i++)
+            result[i] = ElementTraits<OutputType>::fromDouble(ElementTraits<DataType>::toDouble(source.at(i)));
+    }
+    
+    // Neighbour counts are needed for every element, so they are calculated
+    // in a single pass beforehand
+    if (hasNeighbourhoodRestrictions())
+    {
+        countNeighbours(source, workspace.counts);
+        findValidCounts(nDims, workspace.validCounts);
+    }
+    
+    if ((mergeOp == MedianOp || mergeOp == RankOp) && elementOp == IdentityOp && rankByHistogram(source, sourceNeighbourhood, result, workspace))
+        return;
+    else if (!sparse && runByLines(source, sourceNeighbourhood, result, workspace))
+        return;
+    
+    for (size_t a=0; a<nVisited; a++)
+    {
+        const size_t i = sparse ? workspace.active[a] : a;
+        if (!meetsRestrictions(source, i, workspace))
         {
-            samples[i] = original->at(i);
+            result[i] = ElementTraits<OutputType>::fromDouble(ElementTraits<DataType>::toDouble(source.at(i)));
             continue;
         }
         
-        resetValues();
-        original->expandIndex(i, currentLoc);
+        resetValues(values);
+        source.expandIndex(i, workspace.loc);
         
         visitedKernelSum = 0.0;
         
@@ -191,7 +880,7 @@ std::vector<double> & Morpher::run ()
             bool validLoc = true;
             for (int j=0; j<nDims; j++)
             {
-                int currentDimIndex = currentLoc[j] + sourceNeighbourhood.locs(k,j);
+                int currentDimIndex = workspace.loc[j] + sourceNeighbourhood.loc(k,j);
                 if (currentDimIndex < 0 || currentDimIndex >= dims[j])
                     validLoc = false;
             }
@@ -201,34 +890,34 @@ std::vector<double> & Morpher::run ()
                 switch (elementOp)
                 {
                     case PlusOp:
-                    accumulateValue(original->at(i+sourceNeighbourhood.offsets[k]) + kernelArray->at(k));
+                    accumulateValue(values, ElementTraits<DataType>::toDouble(source.at(i+sourceNeighbourhood.offsets[k])) + kernelArray->at(k));
                     break;
                     
                     case MinusOp:
-                    accumulateValue(original->at(i+sourceNeighbourhood.offsets[k]) - kernelArray->at(k));
+                    accumulateValue(values, ElementTraits<DataType>::toDouble(source.at(i+sourceNeighbourhood.offsets[k])) - kernelArray->at(k));
                     break;
                     
                     case MultiplyOp:
-                    accumulateValue(original->at(i+sourceNeighbourhood.offsets[k]) * kernelArray->at(k));
+                    accumulateValue(values, ElementTraits<DataType>::toDouble(source.at(i+sourceNeighbourhood.offsets[k])) * kernelArray->at(k));
                     break;
                     
                     case IdentityOp:
                     if (kernelArray->at(k) != 0.0)
-                        accumulateValue(original->at(i+sourceNeighbourhood.offsets[k]));
+                        accumulateValue(values, ElementTraits<DataType>::toDouble(source.at(i+sourceNeighbourhood.offsets[k])));
                     break;
                     
                     case OneOp:
                     if (kernelArray->at(k) != 0.0)
-                        accumulateValue(1.0);
+                        accumulateValue(values, 1.0);
                     break;
                     
                     case ZeroOp:
                     if (kernelArray->at(k) != 0.0)
-                        accumulateValue(0.0);
+                        accumulateValue(values, 0.0);
                     break;
                     
                     case EqualOp:
-                    accumulateValue(original->at(i+sourceNeighbourhood.offsets[k]) == kernelArray->at(k) ? 1.0 : 0.0);
+                    accumulateValue(values, ElementTraits<DataType>::toDouble(source.at(i+sourceNeighbourhood.offsets[k])) == kernelArray->at(k) ? 1.0 : 0.0);
                     break;
                 }
                 
@@ -237,16 +926,476 @@ std::vector<double> & Morpher::run ()
             }
         }
         
-        samples[i] = mergeValues();
+        double value = mergeValues(values);
         
         if (renormalise && mergeOp == SumOp)
         {
             if (kernelSum != 0.0)
-                samples[i] *= kernelSum;
+                value *= kernelSum;
             if (visitedKernelSum != 0.0)
-                samples[i] /= visitedKernelSum;
+                value /= visitedKernelSum;
+        }
+        
+        result[i] = ElementTraits<OutputType>::fromDouble(value);
+    }
+}
+
+template <typename DataType> template <typename OutputType>
+void Morpher<DataType>::extremesOn (const Array<DataType> &source, const NeighbourhoodTable &sourceNeighbourhood, OutputType * const lower, OutputType * const upper, Workspace &workspace) const
+{
+    const Array<double> * kernelArray = kernel->getArray();
+    const size_t neighbourhoodSize = sourceNeighbourhood.size;
+    const bool flat = (elementOp == IdentityOp);
+    
+    const int_vector &dims = source.getDimensions();
+    int nDims = source.getDimensionality();
+    const size_t nSamples = source.size();
+    workspace.loc.resize(nDims);
+    
+    // Binary arrays with flat kernels only change near boundaries, as for
+    // the single operations
+    const bool sparse = flat && findActiveElements(source, sourceNeighbourhood, workspace);
+    const size_t nVisited = sparse ? workspace.active.size() : nSamples;
+    if (sparse)
+    {
+        for (size_t i=0; i<nSamples; i++)
+        {
+            const double value = ElementTraits<DataType>::toDouble(source[i]);
+            if (lower != NULL)
+                lower[i] = ElementTraits<OutputType>::fromDouble(value);
+            if (upper != NULL)
+                upper[i] = ElementTraits<OutputType>::fromDouble(value);
         }
     }
     
-    return samples;
+    for (size_t a=0; a<nVisited; a++)
+    {
+        const size_t i = sparse ? workspace.active[a] : a;
+        source.expandIndex(i, workspace.loc);
+        double minimum = R_PosInf, maximum = R_NegInf;
+        
+        for (size_t k=0; k<neighbourhoodSize; k++)
+        {
+            bool validLoc = true;
+            for (int j=0; j<nDims; j++)
+            {
+                int currentDimIndex = workspace.loc[j] + sourceNeighbourhood.loc(k,j);
+                if (currentDimIndex < 0 || currentDimIndex >= dims[j])
+                    validLoc = false;
+            }
+            
+            if (!validLoc)
+                continue;
+            
+            const double value = ElementTraits<DataType>::toDouble(source[i+sourceNeighbourhood.offsets[k]]);
+            if (R_IsNA(value))
+                continue;
+            
+            // The dilation uses the kernel reflected through its centre
+            const double erosionWeight = kernelArray->at(k);
+            const double dilationWeight = kernelArray->at(neighbourhoodSize-k-1);
+            if (!R_IsNA(erosionWeight) && (!flat || erosionWeight != 0.0))
+                minimum = std::min(minimum, flat ? value : value - erosionWeight);
+            if (!R_IsNA(dilationWeight) && (!flat || dilationWeight != 0.0))
+                maximum = std::max(maximum, flat ? value : value + dilationWeight);
+        }
+        
+        if (lower != NULL)
+            lower[i] = ElementTraits<OutputType>::fromDouble(minimum);
+        if (upper != NULL)
+            upper[i] = ElementTraits<OutputType>::fromDouble(maximum);
+    }
 }
+
+template <typename DataType>
+void Morpher<DataType>::statisticsOn (const Array<DataType> &source, const NeighbourhoodTable &sourceNeighbourhood, double * const * const statistics, Workspace &workspace) const
+{
+    const Array<double> * kernelArray = kernel->getArray();
+    const size_t neighbourhoodSize = sourceNeighbourhood.size;
+    
+    const int_vector &dims = source.getDimensions();
+    int nDims = source.getDimensionality();
+    const size_t nSamples = source.size();
+    workspace.loc.resize(nDims);
+    
+    // Values are offset by their overall mean before being summed, so that
+    // the variance isn't lost to cancellation when the mean is large
+    double shift = 0.0;
+    size_t nValid = 0;
+    for (size_t i=0; i<nSamples; i++)
+    {
+        const double value = ElementTraits<DataType>::toDouble(source[i]);
+        if (!R_IsNA(value))
+        {
+            shift += value;
+            nValid++;
+        }
+    }
+    if (nValid > 0)
+        shift /= static_cast<double>(nValid);
+    
+    // The kernel is flat, with its nonzero elements defining the
+    // neighbourhood. If that's the whole box, the statistics are separable
+    bool box = true;
+    int_vector radii(nDims, 0);
+    for (size_t k=0; k<neighbourhoodSize; k++)
+    {
+        if (R_IsNA(kernelArray->at(k)) || kernelArray->at(k) == 0.0)
+            box = false;
+        for (int j=0; j<nDims; j++)
+            radii[j] = std::max(radii[j], sourceNeighbourhood.loc(k,j));
+    }
+    
+    double * const counts = statistics[CountStat];
+    double * const sums = statistics[SumStat];
+    double * const means = statistics[MeanStat];
+    double * const variances = statistics[VarianceStat];
+    double * const minima = statistics[MinStat];
+    double * const maxima = statistics[MaxStat];
+    
+    // In the box case the per-element values are reduced in place, with the
+    // sums of squares held in the variance channel until the end
+    if (box)
+    {
+        for (size_t i=0; i<nSamples; i++)
+        {
+            const double value = ElementTraits<DataType>::toDouble(source[i]);
+            const bool valid = !R_IsNA(value);
+            counts[i] = valid ? 1.0 : 0.0;
+            sums[i] = valid ? value - shift : 0.0;
+            variances[i] = sums[i] * sums[i];
+            minima[i] = valid ? value : R_PosInf;
+            maxima[i] = valid ? value : R_NegInf;
+        }
+        
+        const std::vector<size_t> &strides = source.getStrides();
+        boxReduce(counts, nSamples, dims, strides, radii, BoxSum);
+        boxReduce(sums, nSamples, dims, strides, radii, BoxSum);
+        boxReduce(variances, nSamples, dims, strides, radii, BoxSum);
+        boxReduce(minima, nSamples, dims, strides, radii, BoxMin);
+        boxReduce(maxima, nSamples, dims, strides, radii, BoxMax);
+    }
+    else
+    {
+        for (size_t i=0; i<nSamples; i++)
+        {
+            source.expandIndex(i, workspace.loc);
+            double count = 0.0, sum = 0.0, sumSquares = 0.0;
+            double minimum = R_PosInf, maximum = R_NegInf;
+            
+            for (size_t k=0; k<neighbourhoodSize; k++)
+            {
+                if (R_IsNA(kernelArray->at(k)) || kernelArray->at(k) == 0.0)
+                    continue;
+                
+                bool validLoc = true;
+                for (int j=0; j<nDims; j++)
+                {
+                    int currentDimIndex = workspace.loc[j] + sourceNeighbourhood.loc(k,j);
+                    if (currentDimIndex < 0 || currentDimIndex >= dims[j])
+                        validLoc = false;
+                }
+                
+                if (!validLoc)
+                    continue;
+                
+                const double value = ElementTraits<DataType>::toDouble(source[i+sourceNeighbourhood.offsets[k]]);
+                if (R_IsNA(value))
+                    continue;
+                
+                count += 1.0;
+                sum += value - shift;
+                sumSquares += (value - shift) * (value - shift);
+                minimum = std::min(minimum, value);
+                maximum = std::max(maximum, value);
+            }
+            
+            counts[i] = count;
+            sums[i] = sum;
+            variances[i] = sumSquares;
+            minima[i] = minimum;
+            maxima[i] = maximum;
+        }
+    }
+    
+    // Convert the offset sums into the final statistics. The variance uses
+    // the usual unbiased estimator, so it needs at least two values
+    for (size_t i=0; i<nSamples; i++)
+    {
+        const double count = counts[i];
+        const double sum = sums[i];
+        sums[i] = sum + count * shift;
+        if (count == 0.0)
+        {
+            means[i] = minima[i] = maxima[i] = NA_REAL;
+            variances[i] = NA_REAL;
+            continue;
+        }
+        
+        means[i] = shift + sum / count;
+        if (count < 2.0)
+            variances[i] = NA_REAL;
+        else
+            variances[i] = std::max(0.0, (variances[i] - sum * sum / count) / (count - 1.0));
+    }
+}
+
+template <typename DataType> template <typename OutputType>
+void Morpher<DataType>::run (OutputType * const result)
+{
+    const NeighbourhoodTable sourceNeighbourhood(original->getNeighbourhood(kernel->getArray()->getDimensions()));
+    Workspace workspace;
+    runOn(*original, sourceNeighbourhood, result, workspace);
+}
+
+template <typename DataType>
+void Morpher<DataType>::prepareTables ()
+{
+    if (!tablesReady)
+    {
+        sourceNeighbourhood = NeighbourhoodTable(original->getNeighbourhood(kernel->getArray()->getDimensions()));
+        tablesReady = true;
+    }
+}
+
+template <typename DataType> template <typename OutputType>
+void Morpher<DataType>::run (DataType * const source, OutputType * const result)
+{
+    prepareTables();
+    const Array<DataType> array(original->getDimensions(), source);
+    Workspace workspace;
+    runOn(array, sourceNeighbourhood, result, workspace);
+}
+
+template <typename DataType> template <typename OutputType>
+void Morpher<DataType>::runExtremes (DataType * const source, OutputType * const lower, OutputType * const upper)
+{
+    prepareTables();
+    const Array<DataType> array(original->getDimensions(), source);
+    Workspace workspace;
+    extremesOn(array, sourceNeighbourhood, lower, upper, workspace);
+}
+
+// The number of steps per standard deviation in the range weight lookup
+// table, and the number of standard deviations it covers. Weights beyond
+// that are taken to be zero
+static const int rangeTableResolution = 64;
+static const int rangeTableExtent = 6;
+
+template <typename DataType>
+void Morpher<DataType>::runBilateral (DataType * const source, double * const result, const double rangeSigma)
+{
+    if (!(rangeSigma > 0.0))
+        throw std::runtime_error("The range standard deviation must be positive");
+    
+    prepareTables();
+    const Array<DataType> array(original->getDimensions(), source);
+    const size_t nSamples = array.size();
+    if (nSamples == 0)
+        return;
+    
+    // Missing, NaN and infinite values are marked once, and excluded from
+    // every neighbourhood, since they have no meaningful range weight
+    dbl_vector converted;
+    const double * const data = doubleData(array, converted);
+    std::vector<unsigned char> validity(nSamples);
+    for (size_t i=0; i<nSamples; i++)
+        validity[i] = R_FINITE(data[i]) ? 1 : 0;
+    
+    // Gaussian range weights are interpolated from a table, indexed by the
+    // absolute difference from the central value
+    const size_t tableSize = rangeTableResolution * rangeTableExtent + 1;
+    dbl_vector table(tableSize);
+    for (size_t j=0; j<tableSize; j++)
+    {
+        const double difference = static_cast<double>(j) / rangeTableResolution;
+        table[j] = exp(-0.5 * difference * difference);
+    }
+    
+    const Array<double> *kernelArray = kernel->getArray();
+    const NeighbourhoodTable * const neighbourhood = &sourceNeighbourhood;
+    const int * const dims = &array.getDimensions().front();
+    const int nDims = array.getDimensionality();
+    const int length = dims[0];
+    const size_t nLines = nSamples / length;
+    const Array<DataType> * const arrayPtr = &array;
+    const double * const weights = &table.front();
+    const unsigned char * const valid = &validity.front();
+    const double scale = rangeTableResolution / rangeSigma;
+    const double limit = static_cast<double>(tableSize - 1);
+    
+    // Lines are independent, so they are processed in parallel. Each kernel
+    // element is applied along a whole line at once, as in runByLines()
+    PARALLEL_LOOP_START(l, nLines)
+        const size_t start = l * length;
+        int_vector loc(nDims);
+        arrayPtr->expandIndex(start, loc);
+        dbl_vector numerators(length, 0.0), denominators(length, 0.0);
+        
+        for (size_t k=0; k<neighbourhood->size; k++)
+        {
+            const double spatialWeight = kernelArray->at(k);
+            if (R_IsNA(spatialWeight) || spatialWeight == 0.0)
+                continue;
+            
+            bool validLoc = true;
+            for (int j=1; j<nDims; j++)
+            {
+                const int index = loc[j] + neighbourhood->loc(k,j);
+                if (index < 0 || index >= dims[j])
+                    validLoc = false;
+            }
+            
+            const int offset = neighbourhood->loc(k,0);
+            const int first = std::max(0, -offset);
+            const int last = std::min(length, length - offset);
+            if (!validLoc || first >= last)
+                continue;
+            
+            const ptrdiff_t shift = neighbourhood->offsets[k];
+            for (int t=first; t<last; t++)
+            {
+                const size_t i = start + t;
+                if (!valid[i + shift])
+                    continue;
+                
+                const double value = data[i + shift];
+                const double position = fabs(value - data[i]) * scale;
+                if (!(position < limit))
+                    continue;
+                
+                const size_t index = static_cast<size_t>(position);
+                const double fraction = position - index;
+                const double weight = spatialWeight * (weights[index] + fraction * (weights[index+1] - weights[index]));
+                numerators[t] += weight * value;
+                denominators[t] += weight;
+            }
+        }
+        
+        for (int t=0; t<length; t++)
+        {
+            const size_t i = start + t;
+            if (!valid[i])
+                result[i] = data[i];
+            else
+                result[i] = (denominators[t] != 0.0) ? numerators[t] / denominators[t] : NA_REAL;
+        }
+    PARALLEL_LOOP_END
+}
+
+template <typename DataType>
+void Morpher<DataType>::runStatistics (DataType * const source, double * const * const statistics)
+{
+    prepareTables();
+    const Array<DataType> array(original->getDimensions(), source);
+    Workspace workspace;
+    statisticsOn(array, sourceNeighbourhood, statistics, workspace);
+}
+
+template <typename DataType> template <typename OutputType>
+void Morpher<DataType>::run (const std::vector<DataType *> &sources, const std::vector<OutputType *> &results)
+{
+    if (sources.size() != results.size())
+        throw std::runtime_error("The number of results does not match the number of arrays");
+    
+    // The neighbourhood depends only on the dimensions, which all arrays share
+    prepareTables();
+    const int_vector &dims = original->getDimensions();
+    const NeighbourhoodTable *sourcePtr = &sourceNeighbourhood;
+    
+    PARALLEL_LOOP_START(v, sources.size())
+        const Array<DataType> source(dims, sources[v]);
+        Workspace workspace;
+        runOn(source, *sourcePtr, results[v], workspace);
+    PARALLEL_LOOP_END
+}
+
+template <typename DataType> template <typename OutputType>
+void Morpher<DataType>::runInSlabs (OutputType * const result, const size_t slabSize)
+{
+    Array<DataType> * const full = original;
+    int_vector dims = full->getDimensions();
+    const int lastDim = full->getDimensionality() - 1;
+    if (lastDim < 0 || full->empty())
+        return;
+    
+    // The halo must also cover the immediate neighbours, which are used to
+    // check restrictions
+    const int_vector &kernelDims = kernel->getArray()->getDimensions();
+    const int halo = std::max(1, kernelDims.size() > size_t(lastDim) ? (kernelDims[lastDim] - 1) / 2 : 0);
+    
+    const int length = dims[lastDim];
+    const size_t planeSize = full->getStrides()[lastDim];
+    const int step = std::max(1, static_cast<int>(slabSize));
+    std::vector<OutputType> slab;
+    
+    // Each slab is processed by temporarily pointing the original at a view
+    // onto the relevant part of the full array
+    try
+    {
+        for (int start=0; start<length; start+=step)
+        {
+            const int end = std::min(length, start + step);
+            const int lo = std::max(0, start - halo);
+            const int hi = std::min(length, end + halo);
+            
+            dims[lastDim] = hi - lo;
+            original = new Array<DataType>(dims, &(*full)[lo * planeSize]);
+            slab.resize((hi - lo) * planeSize);
+            run(&slab.front());
+            std::copy(slab.begin() + (start - lo) * planeSize, slab.begin() + (end - lo) * planeSize, result + start * planeSize);
+            
+            delete original;
+            original = full;
+        }
+    }
+    catch (...)
+    {
+        if (original != full)
+            delete original;
+        original = full;
+        throw;
+    }
+}
+
+// Explicit instantiations for each supported element type, writing either to
+// the same type or to double precision
+template class Morpher<double>;
+template void Morpher<double>::run (double * const result);
+template void Morpher<double>::runInSlabs (double * const result, const size_t slabSize);
+template void Morpher<double>::run (double * const source, double * const result);
+template void Morpher<double>::run (const std::vector<double *> &sources, const std::vector<double *> &results);
+template void Morpher<double>::runExtremes (double * const source, double * const lower, double * const upper);
+
+template class Morpher<int>;
+template void Morpher<int>::run (int * const result);
+template void Morpher<int>::run (double * const result);
+template void Morpher<int>::runInSlabs (int * const result, const size_t slabSize);
+template void Morpher<int>::runInSlabs (double * const result, const size_t slabSize);
+template void Morpher<int>::run (int * const source, int * const result);
+template void Morpher<int>::run (int * const source, double * const result);
+template void Morpher<int>::run (const std::vector<int *> &sources, const std::vector<int *> &results);
+template void Morpher<int>::run (const std::vector<int *> &sources, const std::vector<double *> &results);
+template void Morpher<int>::runExtremes (int * const source, int * const lower, int * const upper);
+
+template class Morpher<unsigned char>;
+template void Morpher<unsigned char>::run (unsigned char * const result);
+template void Morpher<unsigned char>::run (double * const result);
+template void Morpher<unsigned char>::runInSlabs (unsigned char * const result, const size_t slabSize);
+template void Morpher<unsigned char>::runInSlabs (double * const result, const size_t slabSize);
+template void Morpher<unsigned char>::run (unsigned char * const source, unsigned char * const result);
+template void Morpher<unsigned char>::run (unsigned char * const source, double * const result);
+template void Morpher<unsigned char>::run (const std::vector<unsigned char *> &sources, const std::vector<unsigned char *> &results);
+template void Morpher<unsigned char>::run (const std::vector<unsigned char *> &sources, const std::vector<double *> &results);
+template void Morpher<unsigned char>::runExtremes (unsigned char * const source, unsigned char * const lower, unsigned char * const upper);
+
+template class Morpher<float>;
+template void Morpher<float>::run (float * const result);
+template void Morpher<float>::run (double * const result);
+template void Morpher<float>::runInSlabs (float * const result, const size_t slabSize);
+template void Morpher<float>::runInSlabs (double * const result, const size_t slabSize);
+template void Morpher<float>::run (float * const source, float * const result);
+template void Morpher<float>::run (float * const source, double * const result);
+template void Morpher<float>::run (const std::vector<float *> &sources, const std::vector<float *> &results);
+template void Morpher<float>::run (const std::vector<float *> &sources, const std::vector<double *> &results);
+template void Morpher<float>::runExtremes (float * const source, float * const lower, float * const upper);
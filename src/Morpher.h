@@ -8,40 +8,108 @@ typedef std::vector<double> dbl_vector;
 typedef std::vector<int>    int_vector;
 
 enum ElementOp { PlusOp, MinusOp, MultiplyOp, IdentityOp, OneOp, ZeroOp, EqualOp };
-enum MergeOp { SumOp, MinOp, MaxOp, MeanOp, MedianOp, AllOp, AnyOp };
+enum MergeOp { SumOp, MinOp, MaxOp, MeanOp, MedianOp, AllOp, AnyOp, RankOp };
 
+// Statistics calculated together by Morpher::runStatistics, which index its
+// array of output buffers
+enum LocalStat { CountStat, SumStat, MeanStat, VarianceStat, MinStat, MaxStat, nLocalStats };
+
+// The locations and offsets of a neighbourhood within an array of particular
+// dimensions, held in plain storage so that they can be shared between
+// threads. Locations are stored column-major, like the matrix they come from
+struct NeighbourhoodTable
+{
+    size_t size;
+    int nDims;
+    int_vector locs;
+    std::vector<ptrdiff_t> offsets;
+    
+    NeighbourhoodTable ()
+        : size(0), nDims(0) {}
+    
+    NeighbourhoodTable (const Neighbourhood &neighbourhood)
+        : size(neighbourhood.size), nDims(neighbourhood.locs.ncol()), locs(neighbourhood.locs.begin(), neighbourhood.locs.end()), offsets(neighbourhood.offsets) {}
+    
+    int loc (const size_t k, const int j) const { return locs[k + j*size]; }
+};
+
+// Main class for applying a kernel to an array, templated on the element type
+// of the array. Values are combined in double precision
+template <typename DataType>
 class Morpher
 {
 private:
-    Array<double> *original;
+    Array<DataType> *original;
     DiscreteKernel *kernel;
     
     ElementOp elementOp;
     MergeOp mergeOp;
     
-    Neighbourhood immediateNeighbourhood;
-    int_vector currentLoc;
-    
     dbl_vector includedValues, excludedValues;
     int_vector includedNeighbourhoods, excludedNeighbourhoods;
     
     bool renormalise;
     
-    dbl_vector values;
-    dbl_vector samples;
+    // The quantile found by the rank merge, as a probability
+    double quantile;
+    
+    // The neighbourhood table for the dimensions of the original, which is
+    // calculated on first use and kept for repeated runs
+    NeighbourhoodTable sourceNeighbourhood;
+    bool tablesReady;
+    
+    // Working storage for the location of the current element, the values
+    // being merged, the number of nonzero immediate neighbours of each element,
+    // which of those counts are allowed, and the elements whose values may
+    // change. This is separate for each array processed concurrently
+    struct Workspace
+    {
+        int_vector loc;
+        dbl_vector values;
+        int_vector counts;
+        std::vector<bool> validCounts;
+        std::vector<size_t> active;
+    };
+    
+    bool hasNeighbourhoodRestrictions () const { return (includedNeighbourhoods.size() > 0 || excludedNeighbourhoods.size() > 0); }
+    
+    void countNeighbours (const Array<DataType> &source, int_vector &counts) const;
+    void findValidCounts (const int nDims, std::vector<bool> &valid) const;
+    
+    // Find the elements of a binary array that a selective operation can
+    // change, which are those near the boundaries between zeroes and ones.
+    // Returns false if the operation or array is not suitable
+    bool findActiveElements (const Array<DataType> &source, const NeighbourhoodTable &sourceNeighbourhood, Workspace &workspace) const;
+    bool meetsValueRestrictions (const double value) const;
+    bool meetsRestrictions (const Array<DataType> &source, const size_t n, const Workspace &workspace) const;
+    
+    void resetValues (dbl_vector &values) const;
+    void accumulateValue (dbl_vector &values, double value) const;
+    double mergeValues (dbl_vector &values) const;
+    
+    void prepareTables ();
+    
+    // Find ranks of integer data by sliding a histogram of values along each
+    // line. Returns false if the data are not suitable
+    template <typename OutputType>
+    bool rankByHistogram (const Array<DataType> &source, const NeighbourhoodTable &sourceNeighbourhood, OutputType * const result, Workspace &workspace) const;
     
-    bool meetsRestrictions (const size_t n);
+    // Apply the kernel one line at a time, for common pairs of operations.
+    // Returns false if this is not possible
+    template <typename OutputType>
+    bool runByLines (const Array<DataType> &source, const NeighbourhoodTable &sourceNeighbourhood, OutputType * const result, Workspace &workspace) const;
     
-    void resetValues ();
-    void accumulateValue (double value);
-    double mergeValues ();
+    template <typename OutputType>
+    void runOn (const Array<DataType> &source, const NeighbourhoodTable &sourceNeighbourhood, OutputType * const result, Workspace &workspace) const;
+    
+    void statisticsOn (const Array<DataType> &source, const NeighbourhoodTable &sourceNeighbourhood, double * const * const statistics, Workspace &workspace) const;
+    
+    template <typename OutputType>
+    void extremesOn (const Array<DataType> &source, const NeighbourhoodTable &sourceNeighbourhood, OutputType * const lower, OutputType * const upper, Workspace &workspace) const;
     
 public:
-    Morpher (Array<double> * const original, DiscreteKernel * const kernel, const ElementOp elementOp, const MergeOp mergeOp)
-        : original(original), kernel(kernel), elementOp(elementOp), mergeOp(mergeOp), renormalise(true)
-    {
-        this->immediateNeighbourhood = original->getNeighbourhood(3);
-    }
+    Morpher (Array<DataType> * const original, DiscreteKernel * const kernel, const ElementOp elementOp, const MergeOp mergeOp)
+        : original(original), kernel(kernel), elementOp(elementOp), mergeOp(mergeOp), renormalise(true), quantile(0.5), tablesReady(false) {}
     
     ~Morpher ()
     {
@@ -66,7 +134,70 @@ public:
         this->renormalise = renormalise;
     }
     
-    dbl_vector & run ();
+    void setQuantile (const double quantile)
+    {
+        if (quantile < 0.0 || quantile > 1.0)
+            throw std::runtime_error("Quantile must be between 0 and 1");
+        this->quantile = quantile;
+    }
+    
+    // Whether the result of the operation can always be represented in the
+    // element type of the original array: this is the case when the merged
+    // values are either original values or zeroes and ones
+    bool preservesType () const
+    {
+        const bool selectiveMerge = (mergeOp == MinOp || mergeOp == MaxOp || mergeOp == AllOp || mergeOp == AnyOp);
+        const bool selectiveElement = (elementOp == IdentityOp || elementOp == OneOp || elementOp == ZeroOp || elementOp == EqualOp);
+        return (selectiveMerge && selectiveElement);
+    }
+    
+    // Write the result into the buffer given, which must have the same length
+    // as the original array
+    template <typename OutputType>
+    void run (OutputType * const result);
+    
+    // Apply the kernel to a further array with the same dimensions as the
+    // original, reusing the neighbourhoods calculated for it. Only the
+    // dimensions of the original matter in this case, so a morpher can be set
+    // up once and applied to many arrays
+    template <typename OutputType>
+    void run (DataType * const source, OutputType * const result);
+    
+    // Apply the kernel to a series of further arrays, writing each result to
+    // the corresponding buffer. Arrays are processed in parallel where possible
+    template <typename OutputType>
+    void run (const std::vector<DataType *> &sources, const std::vector<OutputType *> &results);
+    
+    // Calculate the erosion and dilation of an array with the same dimensions
+    // as the original together, in a single sweep over each neighbourhood,
+    // ignoring the merge operation and any restrictions. The kernel is flat
+    // if the element operation is IdentityOp, and otherwise it is subtracted
+    // for the erosion and added, reflected, for the dilation, as in greyscale
+    // morphology. Either result buffer may be NULL
+    template <typename OutputType>
+    void runExtremes (DataType * const source, OutputType * const lower, OutputType * const upper);
+    
+    // Calculate the count, sum, mean, variance, minimum and maximum of the
+    // non-missing values within the nonzero part of the kernel around each
+    // element of an array with the same dimensions as the original, in one
+    // sweep. The statistics array holds one output buffer of the same length
+    // as the array for each, indexed by LocalStat. If the kernel fills its
+    // whole box, running sums are used along each dimension
+    void runStatistics (DataType * const source, double * const * const statistics);
+    
+    // Apply a bilateral filter to an array with the same dimensions as the
+    // original, using the kernel as the spatial weights and a Gaussian with
+    // the specified standard deviation as the range weights. Missing, NaN
+    // and infinite values are ignored, and left unchanged in the result
+    void runBilateral (DataType * const source, double * const result, const double rangeSigma);
+    
+    // Write the result in slabs along the last dimension, each of which is
+    // calculated from only the part of the original that it depends on, with
+    // a halo wide enough for the kernel. Only one slab of results is held in
+    // memory at a time, so the original and the result buffer can be file
+    // mappings much larger than the available memory
+    template <typename OutputType>
+    void runInSlabs (OutputType * const result, const size_t slabSize);
 };
 
 #endif
@@ -29,4 +29,12 @@
 
 #endif
 
+// Ask the compiler to vectorise a loop whose iterations are independent,
+// where OpenMP 4.0 or later is available
+#if defined(_OPENMP) && _OPENMP >= 201307
+#define SIMD_LOOP _Pragma("omp simd")
+#else
+#define SIMD_LOOP
+#endif
+
 #endif
@@ -5,10 +5,17 @@
 
 // Presharpen data (i.e., calculate spline coefficients) along a single line
 // This function is slightly inscrutable but aims to be fast and general
-template <class InputIterator, class OutputIterator>
-void Resampler::presharpen (InputIterator begin, InputIterator end, OutputIterator result)
+template <class KernelType> template <class InputIterator, class OutputIterator>
+void Resampler<KernelType>::presharpen (InputIterator begin, InputIterator end, OutputIterator result)
 {
     const ptrdiff_t len = end - begin;
+    if (len < 2)
+    {
+        if (len == 1)
+            *result = *begin;
+        return;
+    }
+    
     std::vector<double> coefs(len, 0.0);
     
     *result = *begin;
@@ -27,139 +34,620 @@ void Resampler::presharpen (InputIterator begin, InputIterator end, OutputIterat
     }
 }
 
+// Presharpen all lines of an array along one dimension
+template <class KernelType>
+void Resampler<KernelType>::presharpen (Array<double> * const array, const int dim)
+{
+    // Note that a "line" is a set of locations varying only along one
+    // dimension. Blocks of lines are presharpened in contiguous storage
+    const size_t len = array->getDimensions()[dim];
+    if (len == 0)
+        return;
+    
+    PARALLEL_LOOP_START(j, array->countLineBlocks(dim, lineBlockWidth))
+        const LineBlock block = array->lineBlock(j, dim, lineBlockWidth);
+        std::vector<double> tile(block.count * len);
+        array->gatherLines(block, dim, &tile.front());
+        for (size_t k=0; k<block.count; k++)
+            presharpen(tile.begin() + k*len, tile.begin() + (k+1)*len, tile.begin() + k*len);
+        array->scatterLines(block, dim, &tile.front());
+    PARALLEL_LOOP_END
+}
+
 // Presharpen the entire source array
-void Resampler::presharpen ()
+// The original is only copied if it needs to be presharpened; otherwise it is
+// sampled directly
+template <class KernelType>
+void Resampler<KernelType>::presharpen ()
 {
     delete working;
-    working = new Array<double>(*original);
+    working = NULL;
     
     if (toPresharpen)
     {
+        working = new Array<double>(*original);
         for (int i=0; i<working->getDimensionality(); i++)
-        {
-            // Note that a "line" is a set of locations varying only along one dimension
-            for (size_t j=0; j<working->countLines(i); j++)
-                presharpen(working->beginLine(j,i), working->endLine(j,i), working->beginLine(j,i));
-        }
+            presharpen(working, i);
     }
 }
 
-// Single point interpolation for generalised resampling
-template <class InputIterator>
-double Resampler::interpolate (const UncachedInterpolant<InputIterator> data, const double &loc)
-{
-    const int base = (kernelWidth < 2 ? 0 : (static_cast<int>(floor(loc)) - baseOffset));
-    double value = 0.0;
-    for (ptrdiff_t k=base; k<base+kernelWidth; k++)
-        value += data(k) * kernel->evaluate(static_cast<double>(k) - loc);
-    
-    return value;
-}
-
 // Multi-point interpolation for gridded resampling
-template <class OutputIterator>
-void Resampler::interpolate (const CachedInterpolant data, const std::vector<double> &locs, OutputIterator result)
+template <class KernelType> template <class OutputIterator>
+void Resampler<KernelType>::interpolate (const CachedInterpolant &data, const std::vector<double> &locs, OutputIterator result)
 {
+    const ptrdiff_t len = data.length();
     for (size_t j=0; j<locs.size(); j++, ++result)
     {
         const int base = static_cast<int>(kernelWidth < 2 ? round(locs[j]) : floor(locs[j])) - baseOffset;
         double value = 0.0;
+        if (base >= 0 && base + kernelWidth <= len)
+        {
+            // No boundary handling is needed here, so use a simple loop that
+            // the compiler can unroll and vectorise
+            const double *values = data.values();
+            for (ptrdiff_t k=base; k<base+kernelWidth; k++)
+                value += values[k] * kernel->evaluate(static_cast<double>(k) - locs[j]);
+        }
+        else
+        {
+            for (ptrdiff_t k=base; k<base+kernelWidth; k++)
+                value += data(k) * kernel->evaluate(static_cast<double>(k) - locs[j]);
+        }
+        
+        *result = value;
+    }
+}
+
+// Multi-point interpolation for gridded resampling, also calculating the
+// derivative of the interpolated line at each point
+template <class KernelType> template <class OutputIterator>
+void Resampler<KernelType>::interpolate (const CachedInterpolant &data, const std::vector<double> &locs, OutputIterator result, OutputIterator derivativeResult)
+{
+    for (size_t j=0; j<locs.size(); j++, ++result, ++derivativeResult)
+    {
+        const int base = static_cast<int>(kernelWidth < 2 ? round(locs[j]) : floor(locs[j])) - baseOffset;
+        double value = 0.0, derivative = 0.0;
         for (ptrdiff_t k=base; k<base+kernelWidth; k++)
-            value += data(k) * kernel->evaluate(static_cast<double>(k) - locs[j]);
+        {
+            const double x = static_cast<double>(k) - locs[j];
+            value += data(k) * kernel->evaluate(x);
+            derivative += data(k) * weightDerivative(x);
+        }
         
         *result = value;
+        *derivativeResult = derivative;
     }
 }
 
-// Recursive function for sampling at a particular location in space
-// Starts at dim=(image dimensionality) and works down towards zero
-double Resampler::samplePoint (const std::vector<int> &base, const std::vector<double> &offset, const int dim)
+// Interpolate every line of the source array along one dimension, at the
+// locations given, and optionally the derivative along it too. The source and
+// result differ in size only along that dimension, so their lines divide
+// into blocks in the same way
+template <class KernelType>
+void Resampler<KernelType>::interpolateLines (const Array<double> * const source, const std::vector<double> &locs, const int dim, Array<double> * const result, Array<double> * const derivativeResult)
 {
-    double result;
+    const size_t len = source->getDimensions()[dim];
+    const size_t nLocs = locs.size();
+    if (len == 0 || nLocs == 0)
+        return;
     
-    if (dim == 0)
+    PARALLEL_LOOP_START(j, source->countLineBlocks(dim, lineBlockWidth))
+        const LineBlock block = source->lineBlock(j, dim, lineBlockWidth);
+        std::vector<double> tile(block.count * len), resultTile(block.count * nLocs), derivativeTile;
+        source->gatherLines(block, dim, &tile.front());
+        
+        if (derivativeResult == NULL)
+        {
+            for (size_t k=0; k<block.count; k++)
+            {
+                CachedInterpolant interpolant(tile.begin() + k*len, tile.begin() + (k+1)*len);
+                interpolate(interpolant, locs, resultTile.begin() + k*nLocs);
+            }
+        }
+        else
+        {
+            derivativeTile.resize(block.count * nLocs);
+            for (size_t k=0; k<block.count; k++)
+            {
+                CachedInterpolant interpolant(tile.begin() + k*len, tile.begin() + (k+1)*len);
+                interpolate(interpolant, locs, resultTile.begin() + k*nLocs, derivativeTile.begin() + k*nLocs);
+            }
+            derivativeResult->scatterLines(derivativeResult->lineBlock(j, dim, lineBlockWidth), dim, &derivativeTile.front());
+        }
+        
+        result->scatterLines(result->lineBlock(j, dim, lineBlockWidth), dim, &resultTile.front());
+    PARALLEL_LOOP_END
+}
+
+// Calculate interpolation weights within a window of the specified length,
+// which starts at the base element for the sample point. The data are
+// linearly extrapolated by one element beyond each end of the window, and
+// taken to be zero further out, so the weights for taps there are folded back
+// onto the elements within the window. If requested, the derivatives of the
+// weights with respect to the offset are calculated in the same way
+template <class KernelType>
+void Resampler<KernelType>::calculateWeights (const double offset, const int length, double * const weights, double * const derivatives)
+{
+    std::fill(weights, weights + length, 0.0);
+    if (derivatives != NULL)
+        std::fill(derivatives, derivatives + length, 0.0);
+    
+    const int first = (kernelWidth < 2 ? 0 : (static_cast<int>(floor(offset)) - baseOffset));
+    for (int k=first; k<first+kernelWidth; k++)
     {
-        Array<double>::Iterator start = working->beginLine(base, 0);
-        Array<double>::Iterator end = working->endLine(base, 0);
-        if (end > start+kernelWidth)
-            result = interpolate(UncachedInterpolant<Array<double>::Iterator>(start,start+kernelWidth), offset[0]);
+        int target = -1;
+        if (k > -1 && k < length)
+            target = k;
+        else if (length > 1 && k == -1)
+            target = 0;
+        else if (length > 1 && k == length)
+            target = length - 1;
+        else
+            continue;
+        
+        // The neighbour receiving the negative share of an extrapolated tap
+        const int neighbour = (k == -1 ? 1 : length - 2);
+        
+        const double weight = kernel->evaluate(static_cast<double>(k) - offset);
+        if (target == k)
+            weights[k] += weight;
         else
-            result = interpolate(UncachedInterpolant<Array<double>::Iterator>(start,end), offset[0]);
+        {
+            weights[target] += 2.0 * weight;
+            weights[neighbour] -= weight;
+        }
+        
+        if (derivatives != NULL)
+        {
+            const double derivative = weightDerivative(static_cast<double>(k) - offset);
+            if (target == k)
+                derivatives[k] += derivative;
+            else
+            {
+                derivatives[target] += 2.0 * derivative;
+                derivatives[neighbour] -= derivative;
+            }
+        }
     }
-    else
+}
+
+// Sample the working array at a single arbitrary location. Interpolation is
+// separable, so rather than interpolating along each dimension in turn, the
+// weights for each dimension are calculated once and then combined over the
+// window around the point. If a gradient pointer is given, the partial
+// derivatives of the interpolated function along each dimension are written
+// to it, gradientStride elements apart
+template <class KernelType>
+double Resampler<KernelType>::samplePoint (const double * const loc, PointWorkspace &workspace, double * const gradient, const size_t gradientStride)
+{
+    const Array<double> *source = (toPresharpen ? working : original);
+    const int_vector &dims = source->getDimensions();
+    const std::vector<size_t> &strides = source->getStrides();
+    const int nDims = source->getDimensionality();
+    
+    size_t offset = 0;
+    for (int i=0; i<nDims; i++)
     {
-        std::vector<double> elements;
-        const std::vector<int> &dims = working->getDimensions();
-        for (int i=0; i<kernelWidth; i++)
+        int base = static_cast<int>(kernelWidth < 2 ? round(loc[i]) : floor(loc[i])) - baseOffset;
+        if (base < 0)
+            base = 0;
+        else if (base >= dims[i])
+            base = dims[i] - 1;
+        
+        workspace.starts[i] = base;
+        workspace.lengths[i] = std::min(kernelWidth, dims[i] - base);
+        workspace.counters[i] = 0;
+        calculateWeights(loc[i] - static_cast<double>(base), workspace.lengths[i], &workspace.weights[i*kernelWidth], gradient == NULL ? NULL : &workspace.derivatives[i*kernelWidth]);
+        offset += base * strides[i];
+    }
+    
+    if (gradient != NULL)
+    {
+        for (int i=0; i<nDims; i++)
+            gradient[i*gradientStride] = 0.0;
+    }
+    
+    // Step through the window, with the first dimension innermost
+    const double *data = &(*source)[0];
+    const double *weights = &workspace.weights[0];
+    const double *derivatives = &workspace.derivatives[0];
+    double result = 0.0;
+    while (true)
+    {
+        double weight = 1.0;
+        for (int i=1; i<nDims; i++)
+            weight *= weights[i*kernelWidth + workspace.counters[i]];
+        
+        double partial = 0.0;
+        for (int k=0; k<workspace.lengths[0]; k++)
+            partial += weights[k] * data[offset + k];
+        result += weight * partial;
+        
+        if (gradient != NULL)
+        {
+            // Each partial derivative substitutes the derivative weight for
+            // the plain one along its own dimension
+            double partialDerivative = 0.0;
+            for (int k=0; k<workspace.lengths[0]; k++)
+                partialDerivative += derivatives[k] * data[offset + k];
+            gradient[0] += weight * partialDerivative;
+            
+            for (int j=1; j<nDims; j++)
+            {
+                double derivativeWeight = derivatives[j*kernelWidth + workspace.counters[j]];
+                for (int i=1; i<nDims; i++)
+                {
+                    if (i != j)
+                        derivativeWeight *= weights[i*kernelWidth + workspace.counters[i]];
+                }
+                gradient[j*gradientStride] += derivativeWeight * partial;
+            }
+        }
+        
+        int i = 1;
+        for (; i<nDims; i++)
         {
-            std::vector<int> temp = base;
-            temp[dim] += i;
-            if (temp[dim] < dims[dim])
-                elements.push_back(samplePoint(temp, offset, dim-1));
+            offset += strides[i];
+            if (++workspace.counters[i] < workspace.lengths[i])
+                break;
+            offset -= workspace.lengths[i] * strides[i];
+            workspace.counters[i] = 0;
         }
-        result = interpolate(UncachedInterpolant<std::vector<double>::iterator>(elements.begin(),elements.end()), offset[dim]);
+        if (i == nDims)
+            break;
     }
     
     return result;
 }
 
 // Main function for generalised resampling
-const std::vector<double> & Resampler::run (const Rcpp::NumericMatrix &locations)
+template <class KernelType>
+void Resampler<KernelType>::run (const Rcpp::NumericMatrix &locations, double * const result, double * const gradient)
 {
-    const int_vector &dims = original->getDimensions();
     const int nDims = locations.cols();
     const int nSamples = locations.rows();
     
     presharpen();
     
-    samples.resize(nSamples);
-    
     PARALLEL_LOOP_START(k, nSamples)
-        int_vector base(nDims);
-        dbl_vector offset(nDims);
+        PointWorkspace workspace(nDims, kernelWidth);
+        dbl_vector loc(nDims);
+        for (int i=0; i<nDims; i++)
+            loc[i] = locations(k,i);
+        result[k] = samplePoint(&loc[0], workspace, gradient == NULL ? NULL : gradient + k, nSamples);
+    PARALLEL_LOOP_END
+}
+
+// Main function for resampling under an affine transformation. The matrix maps
+// (homogeneous) locations in the output array, whose dimensions are given, to
+// locations in the source array. Locations are generated on the fly, one row
+// of the output at a time, with consecutive elements a fixed step apart
+template <class KernelType>
+void Resampler<KernelType>::transform (const Rcpp::NumericMatrix &matrix, const int_vector &dims, double * const result, double * const gradient)
+{
+    const int nDims = dims.size();
+    
+    size_t nSamples = 1;
+    for (int i=0; i<nDims; i++)
+        nSamples *= dims[i];
+    const size_t nRows = nSamples / dims[0];
+    
+    presharpen();
+    
+    PARALLEL_LOOP_START(j, nRows)
+        PointWorkspace workspace(nDims, kernelWidth);
+        dbl_vector start(nDims), loc(nDims);
         
+        // Find the source location corresponding to the start of the row
+        size_t remainder = j;
         for (int i=0; i<nDims; i++)
+            start[i] = matrix(i,nDims);
+        for (int k=1; k<nDims; k++)
         {
-            base[i] = static_cast<int>(kernelWidth < 2 ? round(locations(k,i)) : floor(locations(k,i))) - baseOffset;
-            offset[i] = locations(k,i) - static_cast<double>(base[i]);
-            if (base[i] < 0)
-            {
-                offset[i] += static_cast<double>(base[i]);
-                base[i] = 0;
-            }
-            else if (base[i] >= dims[i])
-            {
-                offset[i] += static_cast<double>(base[i]) - dims[i] + 1.0;
-                base[i] = dims[i] - 1;
-            }
+            const double index = static_cast<double>(remainder % dims[k]);
+            remainder /= dims[k];
+            for (int i=0; i<nDims; i++)
+                start[i] += matrix(i,k) * index;
+        }
+        
+        // The step along the row is the first column of the matrix. Each
+        // location is calculated from the start, rather than accumulated, to
+        // avoid drift due to rounding errors
+        const size_t rowStart = j * dims[0];
+        for (int l=0; l<dims[0]; l++)
+        {
+            const size_t n = rowStart + l;
+            for (int i=0; i<nDims; i++)
+                loc[i] = start[i] + matrix(i,0) * static_cast<double>(l);
+            result[n] = samplePoint(&loc[0], workspace, gradient == NULL ? NULL : gradient + n, nSamples);
+        }
+    PARALLEL_LOOP_END
+}
+
+// Main function for warping with a dense displacement field. The field has the
+// dimensions of the output, given, plus one more, with one block of
+// displacements per dimension. Each output element is sampled from the source
+// array at its own location plus the displacement there, and the gradient of
+// the source at that point can be calculated in the same pass
+template <class KernelType>
+void Resampler<KernelType>::warp (const Rcpp::NumericVector &field, const int_vector &dims, double * const result, double * const gradient)
+{
+    const int nDims = dims.size();
+    
+    size_t nSamples = 1;
+    for (int i=0; i<nDims; i++)
+        nSamples *= dims[i];
+    const size_t nRows = nSamples / dims[0];
+    
+    if (static_cast<size_t>(field.length()) != nSamples * nDims)
+        throw std::runtime_error("The displacement field does not match the dimensions of the output");
+    
+    presharpen();
+    
+    const double *displacements = field.begin();
+    
+    PARALLEL_LOOP_START(j, nRows)
+        PointWorkspace workspace(nDims, kernelWidth);
+        dbl_vector start(nDims, 0.0), loc(nDims);
+        
+        // Find the indices of the start of the row
+        size_t remainder = j;
+        for (int i=1; i<nDims; i++)
+        {
+            start[i] = static_cast<double>(remainder % dims[i]);
+            remainder /= dims[i];
+        }
+        
+        const size_t rowStart = j * dims[0];
+        for (int l=0; l<dims[0]; l++)
+        {
+            const size_t n = rowStart + l;
+            start[0] = static_cast<double>(l);
+            for (int i=0; i<nDims; i++)
+                loc[i] = start[i] + displacements[n + i*nSamples];
+            result[n] = samplePoint(&loc[0], workspace, gradient == NULL ? NULL : gradient + n, nSamples);
         }
-        samples[k] = samplePoint(base, offset, nDims-1);
     PARALLEL_LOOP_END
+}
+
+// Calculate normalised weights for resampling along a line of length len with
+// a kernel stretched by the specified factor
+template <class KernelType>
+void Resampler<KernelType>::calculateWeights (const std::vector<double> &locs, const ptrdiff_t len, const double stretch, SamplingWeights &result)
+{
+    const double halfWidth = stretch * kernel->getSupportMax();
+    result.nTaps = static_cast<int>(floor(2.0 * halfWidth)) + 1;
+    result.starts.resize(locs.size());
+    result.counts.resize(locs.size());
+    result.weights.assign(locs.size() * result.nTaps, 0.0);
     
-    return samples;
+    for (size_t j=0; j<locs.size(); j++)
+    {
+        // Taps beyond the ends of the line are dropped, and the remaining
+        // weights renormalised, so that the result is a local weighted mean
+        const ptrdiff_t first = std::max(ptrdiff_t(0), static_cast<ptrdiff_t>(ceil(locs[j] - halfWidth)));
+        const ptrdiff_t last = std::min(len - 1, static_cast<ptrdiff_t>(floor(locs[j] + halfWidth)));
+        result.starts[j] = first;
+        result.counts[j] = std::max(0, static_cast<int>(last - first + 1));
+        
+        double sum = 0.0;
+        double *weights = &result.weights[j * result.nTaps];
+        for (int k=0; k<result.counts[j]; k++)
+        {
+            weights[k] = kernel->evaluate((static_cast<double>(first + k) - locs[j]) / stretch);
+            sum += weights[k];
+        }
+        
+        if (sum != 0.0)
+        {
+            for (int k=0; k<result.counts[j]; k++)
+                weights[k] /= sum;
+        }
+    }
 }
 
 // Main function for gridded resampling
-const std::vector<double> & Resampler::run (const std::vector<dbl_vector> &locations)
+// If a stretch factor greater than one is given for a dimension, the kernel is
+// widened by that factor along it, to avoid aliasing when downsampling. If
+// the gradient is requested, the derivative along each dimension is
+// calculated alongside the values when that dimension is resampled, and then
+// carried through the remaining dimensions like the values themselves
+template <class KernelType>
+void Resampler<KernelType>::run (const std::vector<dbl_vector> &locations, const dbl_vector &stretch, double * const output, double * const gradient)
 {
     const int nDims = locations.size();
     int_vector dims = original->getDimensions();
     
-    presharpen();
-
+    size_t nSamples = 1;
     for (int i=0; i<nDims; i++)
+        nSamples *= locations[i].size();
+    if (nSamples == 0 || original->empty())
+        return;
+    
+    if (gradient != NULL)
     {
+        for (size_t i=0; i<stretch.size(); i++)
+        {
+            if (stretch[i] > 1.0)
+                throw std::runtime_error("Gradients are not available with antialiased resampling");
+        }
+    }
+    
+    // Each dimension is resampled from the result for the previous one,
+    // starting with the original, which is only copied if it needs to be
+    // presharpened in place
+    delete working;
+    working = NULL;
+    const Array<double> *source = original;
+    
+    std::vector<Array<double>*> derivatives;
+    
+    // Presharpening is applied to each dimension just before it is
+    // resampled. Since the operations along different dimensions are linear
+    // and independent, the order makes no difference to the result. The
+    // arrays created for the last dimension are views onto the output buffers
+    for (int i=0; i<nDims; i++)
+    {
+        const bool last = (i == nDims - 1);
+        const ptrdiff_t len = dims[i];
         dims[i] = locations[i].size();
-        Array<double> *result = new Array<double>(dims, NA_REAL);
+        Array<double> *result = last ? new Array<double>(dims, output) : new Array<double>(dims, NA_REAL);
         
-        PARALLEL_LOOP_START(j, working->countLines(i))
-            CachedInterpolant interpolant(working->beginLine(j,i), working->endLine(j,i));
-            interpolate(interpolant, locations[i], result->beginLine(j,i));
-        PARALLEL_LOOP_END
+        if (size_t(i) < stretch.size() && stretch[i] > 1.0)
+        {
+            // The stretched kernel acts as a low-pass filter, and the weights
+            // are the same for every line, so they are calculated up front
+            SamplingWeights weights;
+            calculateWeights(locations[i], len, stretch[i], weights);
+            
+            const size_t nLocs = locations[i].size();
+            PARALLEL_LOOP_START(j, source->countLineBlocks(i, lineBlockWidth))
+                const LineBlock block = source->lineBlock(j, i, lineBlockWidth);
+                std::vector<double> tile(block.count * len), resultTile(block.count * nLocs);
+                source->gatherLines(block, i, &tile.front());
+                for (size_t m=0; m<block.count; m++)
+                {
+                    const double *line = &tile[m*len];
+                    double *it = &resultTile[m*nLocs];
+                    for (size_t l=0; l<nLocs; l++, ++it)
+                    {
+                        const double *currentWeights = &weights.weights[l * weights.nTaps];
+                        const double *values = line + weights.starts[l];
+                        double value = 0.0;
+                        for (int k=0; k<weights.counts[l]; k++)
+                            value += currentWeights[k] * values[k];
+                        *it = value;
+                    }
+                }
+                result->scatterLines(result->lineBlock(j, i, lineBlockWidth), i, &resultTile.front());
+            PARALLEL_LOOP_END
+        }
+        else
+        {
+            if (toPresharpen)
+            {
+                if (working == NULL)
+                    working = new Array<double>(*original);
+                presharpen(working, i);
+                source = working;
+                for (size_t d=0; d<derivatives.size(); d++)
+                    presharpen(derivatives[d], i);
+            }
+            
+            // Derivatives along earlier dimensions are interpolated normally
+            for (size_t d=0; d<derivatives.size(); d++)
+            {
+                Array<double> *derivativeResult = last ? new Array<double>(dims, gradient + d*nSamples) : new Array<double>(dims, NA_REAL);
+                interpolateLines(derivatives[d], locations[i], i, derivativeResult);
+                delete derivatives[d];
+                derivatives[d] = derivativeResult;
+            }
+            
+            if (gradient != NULL)
+            {
+                Array<double> *derivativeResult = last ? new Array<double>(dims, gradient + i*nSamples) : new Array<double>(dims, NA_REAL);
+                interpolateLines(source, locations[i], i, result, derivativeResult);
+                derivatives.push_back(derivativeResult);
+            }
+            else
+                interpolateLines(source, locations[i], i, result);
+        }
         
         delete working;
         working = result;
+        source = working;
     }
     
-    return working->getData();
+    for (size_t d=0; d<derivatives.size(); d++)
+        delete derivatives[d];
 }
+
+template <class KernelType>
+void Resampler<KernelType>::runInSlabs (const std::vector<dbl_vector> &locations, const dbl_vector &stretch, double * const result, const size_t slabSize, double * const scratch)
+{
+    const Array<double> * const full = original;
+    int_vector dims = full->getDimensions();
+    const int lastDim = full->getDimensionality() - 1;
+    if (lastDim < 0 || full->empty() || locations.size() != size_t(lastDim + 1))
+        return;
+    
+    const bool wasPresharpened = toPresharpen;
+    Array<double> *sharpened = NULL;
+    
+    const int length = dims[lastDim];
+    const size_t planeSize = full->getStrides()[lastDim];
+    const dbl_vector &lastLocations = locations[lastDim];
+    const int nLocations = lastLocations.size();
+    
+    size_t outputPlaneSize = 1;
+    for (int i=0; i<lastDim; i++)
+        outputPlaneSize *= locations[i].size();
+    
+    // Every tap used for a slab lies within this distance of one of its
+    // sample locations, including any stretching of the kernel, with a
+    // margin so that the ends of the subset of the original are never
+    // reached unless they are also the ends of the full array
+    const double lastStretch = (size_t(lastDim) < stretch.size() ? std::max(1.0, stretch[lastDim]) : 1.0);
+    const int reach = static_cast<int>(ceil(kernel->getSupportMax() * lastStretch)) + 2;
+    const int step = std::max(1, static_cast<int>(slabSize));
+    
+    try
+    {
+        // Presharpening is not local, so it has to cover the whole original.
+        // Each slab then samples the presharpened data directly. As usual,
+        // dimensions with a stretched kernel are not presharpened
+        if (toPresharpen)
+        {
+            if (scratch == NULL)
+                throw std::runtime_error("Scratch space is needed for presharpening in slabs");
+            sharpened = new Array<double>(dims, scratch);
+            std::copy(full->begin(), full->end(), sharpened->begin());
+            for (int i=0; i<=lastDim; i++)
+            {
+                if (size_t(i) >= stretch.size() || stretch[i] <= 1.0)
+                    presharpen(sharpened, i);
+            }
+            toPresharpen = false;
+        }
+        
+        const Array<double> *source = (sharpened == NULL ? full : sharpened);
+        std::vector<dbl_vector> slabLocations(locations);
+        
+        for (int start=0; start<nLocations; start+=step)
+        {
+            const int end = std::min(nLocations, start + step);
+            const double minLocation = *std::min_element(lastLocations.begin() + start, lastLocations.begin() + end);
+            const double maxLocation = *std::max_element(lastLocations.begin() + start, lastLocations.begin() + end);
+            const int lo = std::max(0, std::min(length, static_cast<int>(floor(minLocation)) - reach));
+            const int hi = std::min(length, std::max(lo + 1, static_cast<int>(ceil(maxLocation)) + reach + 1));
+            
+            slabLocations[lastDim].assign(lastLocations.begin() + start, lastLocations.begin() + end);
+            for (size_t l=0; l<slabLocations[lastDim].size(); l++)
+                slabLocations[lastDim][l] -= lo;
+            
+            dims[lastDim] = hi - lo;
+            original = new Array<double>(dims, const_cast<double *>(&(*source)[lo * planeSize]));
+            run(slabLocations, stretch, result + start * outputPlaneSize);
+            delete original;
+            original = full;
+        }
+    }
+    catch (...)
+    {
+        if (original != full)
+            delete original;
+        original = full;
+        toPresharpen = wasPresharpened;
+        delete sharpened;
+        throw;
+    }
+    
+    toPresharpen = wasPresharpened;
+    delete sharpened;
+}
+
+// Explicit instantiations for each supported kernel type
+template class Resampler< PolynomialKernel<0> >;
+template class Resampler< PolynomialKernel<1> >;
+template class Resampler<MitchellNetravaliKernel>;
+template class Resampler<LanczosKernel>;
@@ -1,6 +1,8 @@
 #ifndef _RESAMPLER_H_
 #define _RESAMPLER_H_
 
+#include <limits>
+
 #include "Array.h"
 #include "Kernel.h"
 
@@ -43,6 +45,9 @@ public:
         }
     }
     
+    // Direct access to the underlying values, for use away from the ends
+    const double * values () const { return &data.front(); }
+    
     double operator() (ptrdiff_t i) const
     {
         if (i > -1 && i < ptrdiff_t(len))
@@ -56,73 +61,78 @@ public:
     }
 };
 
-// Uncached version, which is faster for single-pass access
-template <class IteratorType>
-class UncachedInterpolant : public Interpolant
+// Working space for sampling at a single arbitrary point, which holds the
+// start and length of the window along each dimension, and the corresponding
+// interpolation weights and their derivatives. Each thread needs its own copy
+struct PointWorkspace
 {
-private:
-    IteratorType start, end;
-    
-public:
-    UncachedInterpolant (IteratorType start, IteratorType end)
-        : start(start), end(end)
-    {
-        len = end - start;
-        if (len > 1)
-        {
-            prestart = 2*(*start) - (*(++start));
-            --end;
-            postend = 2*(*end) - (*(--end));
-        }
-    }
+    int_vector starts, lengths, counters;
+    dbl_vector weights, derivatives;
     
-    double operator() (ptrdiff_t i) const
-    {
-        if (i > -1 && i < ptrdiff_t(len))
-            return *(start + i);
-        else if (i == -1)
-            return prestart;
-        else if (i == ptrdiff_t(len))
-            return postend;
-        else
-            return 0.0;
-    }
+    PointWorkspace (const int nDims, const int kernelWidth)
+        : starts(nDims), lengths(nDims), counters(nDims), weights(nDims * kernelWidth), derivatives(nDims * kernelWidth) {}
+};
+
+// Precalculated weights for resampling along one dimension, where each sample
+// location uses a contiguous run of up to nTaps source elements
+struct SamplingWeights
+{
+    int nTaps;
+    std::vector<ptrdiff_t> starts;
+    std::vector<int> counts;
+    dbl_vector weights;
 };
 
 // Main class responsible for resampling
+// This is templated on the concrete kernel type, so that kernel evaluations in
+// the innermost interpolation loops are bound statically and can be inlined
+template <class KernelType>
 class Resampler
 {
 protected:
     const Array<double> *original;
     Array<double> *working;
     
-    Kernel *kernel;
+    KernelType *kernel;
     int kernelWidth, baseOffset;
     double a, b, c;
     bool toPresharpen;
     
-    dbl_vector samples;
-    
     template <class InputIterator, class OutputIterator>
     void presharpen (InputIterator begin, InputIterator end, OutputIterator result);
     
+    void presharpen (Array<double> * const array, const int dim);
     void presharpen ();
     
-    // For some reason, the (virtual) call operator doesn't function as expected
-    // if these methods take an Interpolant rather than a derived class
-    template <class InputIterator>
-    double interpolate (const UncachedInterpolant<InputIterator> data, const double &loc);
+    // Derivative of the weight for a tap at displacement x from the sample
+    // point, with respect to the sample location. The weight is a function of
+    // x, hence the sign. A tap exactly at the sample point takes the kernel
+    // derivative from just below zero, so that kernels with a cusp there (like
+    // the triangle) give the same one-sided derivative as the other taps
+    double weightDerivative (const double x) const
+    {
+        return -kernel->derivative(x == 0.0 ? -std::numeric_limits<double>::epsilon() : x);
+    }
     
     template <class OutputIterator>
-    void interpolate (const CachedInterpolant data, const std::vector<double> &locs, OutputIterator result);
+    void interpolate (const CachedInterpolant &data, const std::vector<double> &locs, OutputIterator result);
     
-    double samplePoint (const std::vector<int> &base, const std::vector<double> &offset, const int dim);
+    template <class OutputIterator>
+    void interpolate (const CachedInterpolant &data, const std::vector<double> &locs, OutputIterator result, OutputIterator derivativeResult);
+    
+    void interpolateLines (const Array<double> * const source, const std::vector<double> &locs, const int dim, Array<double> * const result, Array<double> * const derivativeResult = NULL);
+    
+    void calculateWeights (const double offset, const int length, double * const weights, double * const derivatives = NULL);
+    
+    double samplePoint (const double * const loc, PointWorkspace &workspace, double * const gradient = NULL, const size_t gradientStride = 1);
+    
+    void calculateWeights (const std::vector<double> &locs, const ptrdiff_t len, const double stretch, SamplingWeights &result);
     
 public:
     Resampler ()
         : original(NULL), working(NULL), kernel(NULL) {}
     
-    Resampler (const Array<double> *original, Kernel * const kernel)
+    Resampler (const Array<double> *original, KernelType * const kernel)
         : original(original), working(NULL), kernel(kernel)
     {
         kernelWidth = static_cast<int>(floor(2.0 * kernel->getSupportMax()));
@@ -162,9 +172,27 @@ public:
         delete kernel;
     }
     
-    const std::vector<double> & run (const Rcpp::NumericMatrix &locations);
+    bool needsPresharpening () const { return toPresharpen; }
+    
+    // Each of the main functions below writes its samples into the result
+    // buffer given, which must be large enough to hold them. If a gradient
+    // buffer is also given, the partial derivatives of the interpolated array
+    // are written into it, with one block of values per dimension
+    void run (const Rcpp::NumericMatrix &locations, double * const result, double * const gradient = NULL);
+    
+    void run (const std::vector<dbl_vector> &locations, const dbl_vector &stretch, double * const result, double * const gradient = NULL);
+    
+    // Gridded resampling in slabs along the last dimension, each of which is
+    // calculated from only the part of the original that it depends on. This
+    // bounds the working memory, so the original and result buffer can be
+    // file mappings much larger than the available memory. If presharpening
+    // is needed, it is applied to the whole original first, in the scratch
+    // buffer given, which must be the same size as the original
+    void runInSlabs (const std::vector<dbl_vector> &locations, const dbl_vector &stretch, double * const result, const size_t slabSize, double * const scratch = NULL);
+    
+    void transform (const Rcpp::NumericMatrix &matrix, const int_vector &dims, double * const result, double * const gradient = NULL);
     
-    const std::vector<double> & run (const std::vector<dbl_vector> &locations);
+    void warp (const Rcpp::NumericVector &field, const int_vector &dims, double * const result, double * const gradient = NULL);
 };
 
 #endif
@@ -0,0 +1,199 @@
+#include <Rcpp.h>
+
+#include <limits>
+
+#include "Array.h"
+#include "Parallel.h"
+#include "Thresholder.h"
+
+// The number of bins used for values that are not small integers
+static const size_t defaultBins = 4096;
+
+// Whether a value should be included in the histogram
+template <typename DataType>
+static inline bool isFinite (const DataType value)
+{
+    return (!ElementTraits<DataType>::isNA(value) && R_FINITE(ElementTraits<DataType>::toDouble(value)));
+}
+
+template <typename DataType>
+Thresholder::Thresholder (const DataType * const data, const size_t length)
+{
+    // Large arrays are divided into chunks, which each get their own range
+    // and histogram, to be combined afterwards
+    const size_t nChunks = std::max(size_t(1), std::min(size_t(16), length / 1048576));
+    const size_t chunkSize = (length + nChunks - 1) / nChunks;
+    std::vector<double> chunkMinima(nChunks, R_PosInf), chunkMaxima(nChunks, R_NegInf);
+    double * const minima = &chunkMinima.front();
+    double * const maxima = &chunkMaxima.front();
+    
+    PARALLEL_LOOP_START(c, nChunks)
+        const size_t end = std::min(length, (c + 1) * chunkSize);
+        for (size_t i=c*chunkSize; i<end; i++)
+        {
+            if (isFinite(data[i]))
+            {
+                const double value = ElementTraits<DataType>::toDouble(data[i]);
+                minima[c] = std::min(minima[c], value);
+                maxima[c] = std::max(maxima[c], value);
+            }
+        }
+    PARALLEL_LOOP_END
+    
+    const double minValue = *std::min_element(chunkMinima.begin(), chunkMinima.end());
+    const double maxValue = *std::max_element(chunkMaxima.begin(), chunkMaxima.end());
+    if (!R_FINITE(minValue) || minValue == maxValue)
+        throw std::runtime_error("At least two distinct finite values are needed to find a threshold");
+    
+    integerBins = (std::numeric_limits<DataType>::is_integer && maxValue - minValue < 65536.0);
+    const size_t nBins = integerBins ? static_cast<size_t>(maxValue - minValue) + 1 : defaultBins;
+    lowerBound = minValue;
+    binWidth = integerBins ? 1.0 : (maxValue - minValue) / nBins;
+    
+    std::vector<double> chunkCounts(nChunks * nBins, 0.0), chunkSums(nChunks * nBins, 0.0);
+    double * const countsPtr = &chunkCounts.front();
+    double * const sumsPtr = &chunkSums.front();
+    const double lower = lowerBound, width = binWidth;
+    
+    PARALLEL_LOOP_START(c, nChunks)
+        double * const localCounts = countsPtr + c * nBins;
+        double * const localSums = sumsPtr + c * nBins;
+        const size_t end = std::min(length, (c + 1) * chunkSize);
+        for (size_t i=c*chunkSize; i<end; i++)
+        {
+            if (isFinite(data[i]))
+            {
+                const double value = ElementTraits<DataType>::toDouble(data[i]);
+                const size_t bin = std::min(nBins - 1, static_cast<size_t>((value - lower) / width));
+                localCounts[bin] += 1.0;
+                localSums[bin] += value;
+            }
+        }
+    PARALLEL_LOOP_END
+    
+    counts.assign(chunkCounts.begin(), chunkCounts.begin() + nBins);
+    sums.assign(chunkSums.begin(), chunkSums.begin() + nBins);
+    for (size_t c=1; c<nChunks; c++)
+    {
+        for (size_t b=0; b<nBins; b++)
+        {
+            counts[b] += chunkCounts[c * nBins + b];
+            sums[b] += chunkSums[c * nBins + b];
+        }
+    }
+}
+
+double Thresholder::otsu () const
+{
+    const size_t nBins = counts.size();
+    double totalCount = 0.0, totalSum = 0.0;
+    for (size_t b=0; b<nBins; b++)
+    {
+        totalCount += counts[b];
+        totalSum += sums[b];
+    }
+    
+    // Bin b is the last in the lower class. If several splits are equally
+    // good, as when there is a gap in the histogram, the level is placed in
+    // the middle of them
+    double lowerCount = 0.0, lowerSum = 0.0, bestVariance = -1.0;
+    size_t firstBest = 0, lastBest = 0;
+    for (size_t b=0; b<nBins-1; b++)
+    {
+        lowerCount += counts[b];
+        lowerSum += sums[b];
+        const double upperCount = totalCount - lowerCount;
+        if (lowerCount == 0.0 || upperCount == 0.0)
+            continue;
+        
+        const double difference = lowerSum / lowerCount - (totalSum - lowerSum) / upperCount;
+        const double variance = lowerCount * upperCount * difference * difference;
+        if (variance > bestVariance)
+        {
+            bestVariance = variance;
+            firstBest = lastBest = b;
+        }
+        else if (variance == bestVariance && lastBest == b - 1)
+            lastBest = b;
+    }
+    
+    return ((binEdge(firstBest + 1) + binEdge(lastBest + 1)) / 2.0);
+}
+
+double Thresholder::kmeans () const
+{
+    const size_t nBins = counts.size();
+    double totalCount = 0.0, totalSum = 0.0;
+    for (size_t b=0; b<nBins; b++)
+    {
+        totalCount += counts[b];
+        totalSum += sums[b];
+    }
+    
+    // Alternately assign bins to the nearer centre, and move the centres to
+    // the means of their classes, until the boundary between them is stable
+    double level = totalSum / totalCount;
+    for (int iteration=0; iteration<1000; iteration++)
+    {
+        double lowerCount = 0.0, lowerSum = 0.0;
+        for (size_t b=0; b<nBins && binCentre(b) < level; b++)
+        {
+            lowerCount += counts[b];
+            lowerSum += sums[b];
+        }
+        
+        if (lowerCount == 0.0 || lowerCount == totalCount)
+            break;
+        
+        const double newLevel = (lowerSum / lowerCount + (totalSum - lowerSum) / (totalCount - lowerCount)) / 2.0;
+        if (newLevel == level)
+            break;
+        level = newLevel;
+    }
+    
+    return level;
+}
+
+double Thresholder::triangle () const
+{
+    const size_t nBins = counts.size();
+    size_t peak = 0, first = nBins, last = 0;
+    for (size_t b=0; b<nBins; b++)
+    {
+        if (counts[b] > counts[peak])
+            peak = b;
+        if (counts[b] > 0.0)
+        {
+            first = std::min(first, b);
+            last = b;
+        }
+    }
+    
+    // The line runs from the peak to the end of the longer tail, and the
+    // level is placed just above the bin furthest below it
+    const bool rightTail = (last - peak >= peak - first);
+    const size_t end = rightTail ? last : first;
+    if (end == peak)
+        return binEdge(peak + 1);
+    
+    const double slope = (counts[end] - counts[peak]) / (static_cast<double>(end) - static_cast<double>(peak));
+    size_t best = peak;
+    double bestDistance = -1.0;
+    const size_t from = std::min(peak, end), to = std::max(peak, end);
+    for (size_t b=from; b<=to; b++)
+    {
+        const double distance = counts[peak] + slope * (static_cast<double>(b) - static_cast<double>(peak)) - counts[b];
+        if (distance > bestDistance)
+        {
+            bestDistance = distance;
+            best = b;
+        }
+    }
+    
+    return binEdge(best + 1);
+}
+
+// Explicit instantiations for each supported element type
+template Thresholder::Thresholder (const double * const data, const size_t length);
+template Thresholder::Thresholder (const int * const data, const size_t length);
+template Thresholder::Thresholder (const unsigned char * const data, const size_t length);
@@ -0,0 +1,39 @@
+#ifndef _THRESHOLDER_H_
+#define _THRESHOLDER_H_
+
+#include <vector>
+
+// Automatic selection of a global threshold from a histogram of the finite
+// values of an array. Integer data with a modest range get one bin per value,
+// so the thresholds found are exact; otherwise values are divided into a
+// fixed number of equal bins. The sum of the values in each bin is kept as
+// well as their number, so class means are exact either way. The histogram
+// is built in two passes over the data, split into chunks which are
+// processed in parallel where possible
+class Thresholder
+{
+private:
+    double lowerBound, binWidth;
+    bool integerBins;
+    std::vector<double> counts, sums;
+    
+    // The value at the lower edge of a bin, and at its centre
+    double binEdge (const size_t bin) const { return lowerBound + bin * binWidth; }
+    double binCentre (const size_t bin) const { return integerBins ? binEdge(bin) : binEdge(bin) + binWidth / 2.0; }
+    
+public:
+    template <typename DataType>
+    Thresholder (const DataType * const data, const size_t length);
+    
+    // Each method returns a level such that values below it fall into the
+    // lower class. Otsu's method maximises the variance between the classes;
+    // the k-means method is two-class k-means clustering (also known as the
+    // isodata method), started from the mean; and the triangle method finds
+    // the point of the histogram furthest below a line from its peak to the
+    // end of its longer tail
+    double otsu () const;
+    double kmeans () const;
+    double triangle () const;
+};
+
+#endif
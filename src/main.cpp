@@ -1,9 +1,13 @@
 #include <Rcpp.h>
 
+#include "Automaton.h"
+#include "BilateralGrid.h"
 #include "Componenter.h"
 #include "Distancer.h"
 #include "Resampler.h"
+#include "Thresholder.h"
 #include "Morpher.h"
+#include "MappedFile.h"
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -12,20 +16,130 @@
 using namespace Rcpp;
 using namespace std;
 
-Array<double> * arrayFromData (SEXP data_)
+// Pointers to the contents of R vectors of each storage type that can be
+// wrapped directly. Logical vectors are stored as integers
+template <typename DataType> DataType * vectorData (SEXP data_);
+template <> double * vectorData<double> (SEXP data_) { return REAL(data_); }
+template <> int * vectorData<int> (SEXP data_) { return (TYPEOF(data_) == LGLSXP ? LOGICAL(data_) : INTEGER(data_)); }
+template <> unsigned char * vectorData<unsigned char> (SEXP data_) { return RAW(data_); }
+
+int_vector dimensionsOf (const RObject &data)
 {
-    NumericVector data(data_);
-    
     int_vector dim;
     if (data.hasAttribute("dim"))
         dim = as<int_vector>(data.attr("dim"));
     else
     {
         dim = int_vector(1);
-        dim[0] = data.length();
+        dim[0] = Rf_length(data);
     }
-        
-    Array<double> *array = new Array<double>(dim, as<dbl_vector>(data));
+    return dim;
+}
+
+// Wrap an R vector whose storage type matches the element type, without
+// copying its data
+template <typename DataType>
+Array<DataType> * arrayFromData (SEXP data_)
+{
+    RObject data(data_);
+    Array<DataType> *array = new Array<DataType>(dimensionsOf(data), vectorData<DataType>(data_));
+    
+    if (data.hasAttribute("pixdim"))
+        array->setPixelDimensions(as<dbl_vector>(data.attr("pixdim")));
+    
+    return array;
+}
+
+// Arrays stored in files are described by a list giving the path, dimensions,
+// element type and byte offset of the data, which are in R's usual element
+// order. They are accessed through memory mappings
+size_t elementSize (const string &type)
+{
+    if (type.compare("double") == 0)
+        return sizeof(double);
+    else if (type.compare("integer") == 0)
+        return sizeof(int);
+    else if (type.compare("raw") == 0)
+        return sizeof(unsigned char);
+    else if (type.compare("float") == 0)
+        return sizeof(float);
+    else
+        throw std::runtime_error("Unsupported element type: " + type);
+}
+
+size_t fileArrayLength (const List &spec)
+{
+    const int_vector dims = as<int_vector>(spec["dim"]);
+    size_t length = 1;
+    for (size_t i=0; i<dims.size(); i++)
+        length *= dims[i];
+    return length;
+}
+
+MappedFile * mapFileArray (const List &spec, const MappedFile::Mode mode)
+{
+    const string path = as<string>(spec["path"]);
+    const size_t offset = static_cast<size_t>(as<double>(spec["offset"]));
+    const size_t length = fileArrayLength(spec) * elementSize(as<string>(spec["type"]));
+    if (mode == MappedFile::ReadWrite)
+        MappedFile::reserve(path, offset + length);
+    return new MappedFile(path, offset, length, mode);
+}
+
+bool isFileArray (SEXP data_)
+{
+    return Rf_inherits(data_, "fileArray");
+}
+
+// Wrap a file array whose element type matches, through a mapping which the
+// array then owns. Read-only mappings are shared with the file, so pages are
+// only read when first touched, and not at all if the array is never used
+template <typename DataType>
+Array<DataType> * arrayFromFile (const List &spec, const MappedFile::Mode mode = MappedFile::ReadOnly)
+{
+    Array<DataType> *array = new Array<DataType>(as<int_vector>(spec["dim"]), mapFileArray(spec, mode));
+    
+    if (spec.containsElementNamed("pixdim") && !Rf_isNull(spec["pixdim"]))
+        array->setPixelDimensions(as<dbl_vector>(spec["pixdim"]));
+    
+    return array;
+}
+
+// Convert an array of any element type to double precision, in memory
+template <typename DataType>
+Array<double> * convertedArray (const Array<DataType> *source)
+{
+    Array<double> *array = new Array<double>(source->getDimensions(), 0.0);
+    for (size_t i=0; i<source->size(); i++)
+        (*array)[i] = ElementTraits<DataType>::toDouble((*source)[i]);
+    array->setPixelDimensions(source->getPixelDimensions());
+    delete source;
+    return array;
+}
+
+// Double-precision arrays can be created from any numeric vector, or file
+// array. Double data can be used in place; anything else has to be converted,
+// and the array then owns the converted copy
+Array<double> * arrayFromData (SEXP data_)
+{
+    if (TYPEOF(data_) == REALSXP)
+        return arrayFromData<double>(data_);
+    else if (isFileArray(data_))
+    {
+        const List spec(data_);
+        const string type = as<string>(spec["type"]);
+        if (type.compare("double") == 0)
+            return arrayFromFile<double>(spec);
+        else if (type.compare("integer") == 0)
+            return convertedArray(arrayFromFile<int>(spec));
+        else if (type.compare("raw") == 0)
+            return convertedArray(arrayFromFile<unsigned char>(spec));
+        else
+            return convertedArray(arrayFromFile<float>(spec));
+    }
+    
+    NumericVector data(data_);
+    Array<double> *array = new Array<double>(dimensionsOf(data), as<dbl_vector>(data));
     
     if (data.hasAttribute("pixdim"))
         array->setPixelDimensions(as<dbl_vector>(data.attr("pixdim")));
@@ -33,6 +147,21 @@ Array<double> * arrayFromData (SEXP data_)
     return array;
 }
 
+// The specification of a new file array of double-precision values, or of the
+// specified type, matching another in size
+List resultSpec (const List &spec, SEXP path_, const string &type = "double")
+{
+    return List::create(Named("path")=path_, Named("dim")=spec["dim"], Named("type")=type, Named("offset")=0.0, Named("pixdim")=spec["pixdim"]);
+}
+
+LanczosKernel * lanczosKernelFromElements (const List &kernelElements)
+{
+    // Kernel objects created by older versions of the package have no parameters
+    const int lobes = kernelElements.containsElementNamed("a") ? as<int>(kernelElements["a"]) : 3;
+    const bool tabulate = kernelElements.containsElementNamed("tabulated") ? as<bool>(kernelElements["tabulated"]) : false;
+    return KernelGenerator::lanczos(lobes, tabulate);
+}
+
 Kernel * kernelFromElements (SEXP kernel_)
 {
     List kernelElements(kernel_);
@@ -46,7 +175,7 @@ Kernel * kernelFromElements (SEXP kernel_)
     else if (kernelName.compare("mitchell-netravali") == 0)
         kernel = KernelGenerator::mitchellNetravali(as<double>(kernelElements["B"]), as<double>(kernelElements["C"]));
     else if (kernelName.compare("lanczos") == 0)
-        kernel = KernelGenerator::lanczos();
+        kernel = lanczosKernelFromElements(kernelElements);
     
     return kernel;
 }
@@ -115,15 +244,23 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP sample_kernel (SEXP kernel_, SEXP values_)
+RcppExport SEXP sample_kernel (SEXP kernel_, SEXP values_, SEXP derivative_)
 {
 BEGIN_RCPP
     Kernel *kernel = kernelFromElements(kernel_);
     NumericVector values(values_);
     NumericVector result(values.length());
     
-    for (int i=0; i<values.length(); i++)
-        result[i] = kernel->evaluate(values[i]);
+    if (as<bool>(derivative_))
+    {
+        for (int i=0; i<values.length(); i++)
+            result[i] = kernel->derivative(values[i]);
+    }
+    else
+    {
+        for (int i=0; i<values.length(); i++)
+            result[i] = kernel->evaluate(values[i]);
+    }
     
     delete kernel;
     
@@ -131,26 +268,51 @@ BEGIN_RCPP
 END_RCPP
 }
 
-RcppExport SEXP resample (SEXP data_, SEXP kernel_, SEXP samplingScheme_, SEXP threads_)
+// Run a resampler specialised to a particular kernel type
+template <class KernelType>
+SEXP runResampler (Array<double> *array, KernelType *kernel, const List &samplingScheme)
 {
-BEGIN_RCPP
-    Array<double> *array = arrayFromData(data_);
-    Kernel *kernel = kernelFromElements(kernel_);
-    Resampler resampler(array, kernel);
-
-    List samplingScheme(samplingScheme_);
+    Resampler<KernelType> resampler(array, kernel);
     string schemeType = as<string>(samplingScheme["type"]);
+    const bool withGradient = samplingScheme.containsElementNamed("gradient") && as<bool>(samplingScheme["gradient"]);
     
-#ifdef _OPENMP
-    if (!Rf_isNull(threads_) && as<int>(threads_) > 0)
-        omp_set_num_threads(as<int>(threads_));
-#endif
+    // The output vectors are allocated up front, and filled in place by the
+    // resampler, so their sizes need to be worked out here
+    size_t nSamples = 1;
+    int nDims;
+    if (schemeType.compare("general") == 0)
+    {
+        NumericMatrix points = samplingScheme["points"];
+        nSamples = points.rows();
+        nDims = points.cols();
+    }
+    else if (schemeType.compare("grid") == 0)
+    {
+        List points = samplingScheme["points"];
+        nDims = points.length();
+        for (int i=0; i<nDims; i++)
+            nSamples *= Rf_length(points[i]);
+    }
+    else if (schemeType.compare("affine") == 0 || schemeType.compare("warp") == 0)
+    {
+        const int_vector dims = as<int_vector>(samplingScheme["dim"]);
+        nDims = dims.size();
+        for (int i=0; i<nDims; i++)
+            nSamples *= dims[i];
+    }
+    else
+        throw std::runtime_error("Scheme type unsupported");
+    
+    NumericVector result(nSamples);
+    NumericVector gradient;
+    if (withGradient)
+        gradient = NumericVector(nSamples * nDims);
+    double *gradientPtr = withGradient ? gradient.begin() : NULL;
     
     if (schemeType.compare("general") == 0)
     {
         NumericMatrix points = samplingScheme["points"];
-        const dbl_vector &samples = resampler.run(points);
-        return wrap(samples);
+        resampler.run(points, result.begin(), gradientPtr);
     }
     else if (schemeType.compare("grid") == 0)
     {
@@ -158,97 +320,909 @@ BEGIN_RCPP
         vector<dbl_vector> samplingVector(points.length());
         for (int i=0; i<points.length(); i++)
             samplingVector[i] = as<dbl_vector>(points[i]);
-        const dbl_vector &samples = resampler.run(samplingVector);
-        return wrap(samples);
+        dbl_vector stretch;
+        if (samplingScheme.containsElementNamed("stretch"))
+            stretch = as<dbl_vector>(samplingScheme["stretch"]);
+        resampler.run(samplingVector, stretch, result.begin(), gradientPtr);
+    }
+    else if (schemeType.compare("affine") == 0)
+    {
+        NumericMatrix matrix = samplingScheme["matrix"];
+        resampler.transform(matrix, as<int_vector>(samplingScheme["dim"]), result.begin(), gradientPtr);
     }
     else
-        throw std::runtime_error("Scheme type unsupported");
+    {
+        NumericVector field = samplingScheme["field"];
+        resampler.warp(field, as<int_vector>(samplingScheme["dim"]), result.begin(), gradientPtr);
+    }
+    
+    // Gradients, if requested, are returned with one block per dimension
+    if (withGradient)
+        result.attr("gradient") = gradient;
+    return result;
+}
+
+RcppExport SEXP resample (SEXP data_, SEXP kernel_, SEXP samplingScheme_, SEXP threads_)
+{
+BEGIN_RCPP
+    List kernelElements(kernel_);
+    string kernelName = as<string>(kernelElements["name"]);
+    List samplingScheme(samplingScheme_);
+    
+#ifdef _OPENMP
+    if (!Rf_isNull(threads_) && as<int>(threads_) > 0)
+        omp_set_num_threads(as<int>(threads_));
+#endif
+    
+    if (kernelName.compare("box") == 0)
+        return runResampler(arrayFromData(data_), KernelGenerator::box(), samplingScheme);
+    else if (kernelName.compare("triangle") == 0)
+        return runResampler(arrayFromData(data_), KernelGenerator::triangle(), samplingScheme);
+    else if (kernelName.compare("mitchell-netravali") == 0)
+        return runResampler(arrayFromData(data_), KernelGenerator::mitchellNetravali(as<double>(kernelElements["B"]), as<double>(kernelElements["C"])), samplingScheme);
+    else if (kernelName.compare("lanczos") == 0)
+        return runResampler(arrayFromData(data_), lanczosKernelFromElements(kernelElements), samplingScheme);
+    else
+        throw std::runtime_error("Kernel type unsupported");
 END_RCPP
 }
 
-RcppExport SEXP morph (SEXP data_, SEXP kernel_, SEXP elementOp_, SEXP mergeOp_, SEXP restrictions_, SEXP renormalise_)
+// Run a gridded resampler on a double-precision file array, in slabs,
+// writing the result to another file. Presharpening, if needed, uses a
+// scratch file the same size as the original
+template <class KernelType>
+SEXP runResamplerOnFile (const List &spec, KernelType *kernel, const List &samplingScheme, SEXP result_, SEXP scratch_, const size_t slabSize)
+{
+    if (as<string>(spec["type"]).compare("double") != 0)
+    {
+        delete kernel;
+        throw std::runtime_error("Only double-precision file arrays can be resampled");
+    }
+    
+    List points = samplingScheme["points"];
+    vector<dbl_vector> samplingVector(points.length());
+    int_vector dims(points.length());
+    for (int i=0; i<points.length(); i++)
+    {
+        samplingVector[i] = as<dbl_vector>(points[i]);
+        dims[i] = samplingVector[i].size();
+    }
+    dbl_vector stretch;
+    if (samplingScheme.containsElementNamed("stretch"))
+        stretch = as<dbl_vector>(samplingScheme["stretch"]);
+    
+    const List result = List::create(Named("path")=result_, Named("dim")=dims, Named("type")="double", Named("offset")=0.0, Named("pixdim")=R_NilValue);
+    MappedFile *output = NULL, *scratch = NULL;
+    
+    try
+    {
+        output = mapFileArray(result, MappedFile::ReadWrite);
+        Resampler<KernelType> resampler(arrayFromFile<double>(spec), kernel);
+        if (resampler.needsPresharpening())
+            scratch = mapFileArray(resultSpec(spec, scratch_), MappedFile::ReadWrite);
+        resampler.runInSlabs(samplingVector, stretch, static_cast<double *>(output->data()), slabSize, scratch == NULL ? NULL : static_cast<double *>(scratch->data()));
+    }
+    catch (...)
+    {
+        delete output;
+        delete scratch;
+        throw;
+    }
+    
+    delete output;
+    delete scratch;
+    return result;
+}
+
+RcppExport SEXP resample_file (SEXP data_, SEXP kernel_, SEXP samplingScheme_, SEXP result_, SEXP scratch_, SEXP slabSize_, SEXP threads_)
 {
 BEGIN_RCPP
-    Array<double> *array = arrayFromData(data_);
+    List kernelElements(kernel_);
+    string kernelName = as<string>(kernelElements["name"]);
+    List spec(data_);
+    List samplingScheme(samplingScheme_);
+    const size_t slabSize = static_cast<size_t>(as<int>(slabSize_));
+    
+#ifdef _OPENMP
+    if (!Rf_isNull(threads_) && as<int>(threads_) > 0)
+        omp_set_num_threads(as<int>(threads_));
+#endif
+    
+    if (kernelName.compare("box") == 0)
+        return runResamplerOnFile(spec, KernelGenerator::box(), samplingScheme, result_, scratch_, slabSize);
+    else if (kernelName.compare("triangle") == 0)
+        return runResamplerOnFile(spec, KernelGenerator::triangle(), samplingScheme, result_, scratch_, slabSize);
+    else if (kernelName.compare("mitchell-netravali") == 0)
+        return runResamplerOnFile(spec, KernelGenerator::mitchellNetravali(as<double>(kernelElements["B"]), as<double>(kernelElements["C"])), samplingScheme, result_, scratch_, slabSize);
+    else if (kernelName.compare("lanczos") == 0)
+        return runResamplerOnFile(spec, lanczosKernelFromElements(kernelElements), samplingScheme, result_, scratch_, slabSize);
+    else
+        throw std::runtime_error("Kernel type unsupported");
+END_RCPP
+}
+
+ElementOp elementOpFromString (const string &opString)
+{
+    if (opString.compare("+") == 0)
+        return PlusOp;
+    else if (opString.compare("-") == 0)
+        return MinusOp;
+    else if (opString.compare("*") == 0)
+        return MultiplyOp;
+    else if (opString.compare("i") == 0)
+        return IdentityOp;
+    else if (opString.compare("1") == 0)
+        return OneOp;
+    else if (opString.compare("0") == 0)
+        return ZeroOp;
+    else if (opString.compare("==") == 0)
+        return EqualOp;
+    else
+        throw runtime_error("Unsupported element operation specified");
+}
+
+MergeOp mergeOpFromString (const string &opString)
+{
+    if (opString.compare("sum") == 0)
+        return SumOp;
+    else if (opString.compare("min") == 0)
+        return MinOp;
+    else if (opString.compare("max") == 0)
+        return MaxOp;
+    else if (opString.compare("mean") == 0)
+        return MeanOp;
+    else if (opString.compare("median") == 0)
+        return MedianOp;
+    else if (opString.compare("all") == 0)
+        return AllOp;
+    else if (opString.compare("any") == 0)
+        return AnyOp;
+    else if (opString.compare("rank") == 0)
+        return RankOp;
+    else
+        throw runtime_error("Unsupported merge operation specified");
+}
+
+// Run a morpher on an array of a particular element type. The result keeps
+// the storage type of the original where the operation allows it
+template <typename DataType>
+void setRestrictions (Morpher<DataType> &morpher, const List &restrictions, const bool renormalise)
+{
+    morpher.setValidNeighbourhoods(as<int_vector>(restrictions["nNeighbours"]), as<int_vector>(restrictions["nNeighboursNot"]));
+    morpher.setValidValues(as<dbl_vector>(restrictions["value"]), as<dbl_vector>(restrictions["valueNot"]));
+    morpher.shouldRenormalise(renormalise);
     
+    // The quantile for the rank merge travels with the restrictions
+    if (restrictions.containsElementNamed("quantile"))
+        morpher.setQuantile(as<double>(restrictions["quantile"]));
+}
+
+template <typename DataType>
+SEXP runMorpher (Array<DataType> *array, DiscreteKernel *kernel, const ElementOp elementOp, const MergeOp mergeOp, const List &restrictions, const bool renormalise, const int storageType)
+{
+    Morpher<DataType> morpher(array, kernel, elementOp, mergeOp);
+    setRestrictions(morpher, restrictions, renormalise);
+    
+    if (morpher.preservesType())
+    {
+        RObject result(Rf_allocVector(storageType, array->size()));
+        morpher.run(vectorData<DataType>(result));
+        return result;
+    }
+    else
+    {
+        NumericVector result(array->size());
+        morpher.run(result.begin());
+        return result;
+    }
+}
+
+RcppExport SEXP morph (SEXP data_, SEXP kernel_, SEXP elementOp_, SEXP mergeOp_, SEXP restrictions_, SEXP renormalise_)
+{
+BEGIN_RCPP
     Array<double> *kernelArray = arrayFromData(kernel_);
     DiscreteKernel *kernel = new DiscreteKernel(kernelArray);
     
-    const string elementOpString = as<string>(elementOp_);
-    ElementOp elementOp;
-    if (elementOpString.compare("+") == 0)
-        elementOp = PlusOp;
-    else if (elementOpString.compare("-") == 0)
-        elementOp = MinusOp;
-    else if (elementOpString.compare("*") == 0)
-        elementOp = MultiplyOp;
-    else if (elementOpString.compare("i") == 0)
-        elementOp = IdentityOp;
-    else if (elementOpString.compare("1") == 0)
-        elementOp = OneOp;
-    else if (elementOpString.compare("0") == 0)
-        elementOp = ZeroOp;
-    else if (elementOpString.compare("==") == 0)
-        elementOp = EqualOp;
+    const ElementOp elementOp = elementOpFromString(as<string>(elementOp_));
+    const MergeOp mergeOp = mergeOpFromString(as<string>(mergeOp_));
+    
+    // Integer, logical and raw data are processed in their native types
+    List restrictions(restrictions_);
+    const bool renormalise = as<bool>(renormalise_);
+    switch (TYPEOF(data_))
+    {
+        case INTSXP:
+        case LGLSXP:
+        return runMorpher(arrayFromData<int>(data_), kernel, elementOp, mergeOp, restrictions, renormalise, TYPEOF(data_));
+        
+        case RAWSXP:
+        return runMorpher(arrayFromData<unsigned char>(data_), kernel, elementOp, mergeOp, restrictions, renormalise, RAWSXP);
+        
+        default:
+        return runMorpher(arrayFromData(data_), kernel, elementOp, mergeOp, restrictions, renormalise, REALSXP);
+    }
+END_RCPP
+}
+
+// Run a morpher over a series of arrays with the same dimensions, which are
+// either the elements of a list, or consecutive blocks along the last
+// dimension of a larger array. The result takes the same form as the data
+template <typename DataType>
+SEXP runMorpherOnVolumes (SEXP data_, DiscreteKernel *kernel, const ElementOp elementOp, const MergeOp mergeOp, const List &restrictions, const bool renormalise, const int storageType)
+{
+    const bool isList = (TYPEOF(data_) == VECSXP);
+    int_vector dims;
+    size_t nVolumes, volumeSize = 1;
+    if (isList)
+    {
+        nVolumes = Rf_length(data_);
+        if (nVolumes > 0)
+            dims = dimensionsOf(RObject(VECTOR_ELT(data_, 0)));
+    }
     else
-        throw runtime_error("Unsupported element operation specified");
+    {
+        dims = dimensionsOf(RObject(data_));
+        nVolumes = dims.back();
+        dims.pop_back();
+    }
+    for (size_t i=0; i<dims.size(); i++)
+        volumeSize *= dims[i];
     
-    const string mergeOpString = as<string>(mergeOp_);
-    MergeOp mergeOp;
-    if (mergeOpString.compare("sum") == 0)
-        mergeOp = SumOp;
-    else if (mergeOpString.compare("min") == 0)
-        mergeOp = MinOp;
-    else if (mergeOpString.compare("max") == 0)
-        mergeOp = MaxOp;
-    else if (mergeOpString.compare("mean") == 0)
-        mergeOp = MeanOp;
-    else if (mergeOpString.compare("median") == 0)
-        mergeOp = MedianOp;
-    else if (mergeOpString.compare("all") == 0)
-        mergeOp = AllOp;
-    else if (mergeOpString.compare("any") == 0)
-        mergeOp = AnyOp;
+    vector<DataType *> sources(nVolumes);
+    for (size_t v=0; v<nVolumes; v++)
+    {
+        if (!isList)
+            sources[v] = vectorData<DataType>(data_) + v * volumeSize;
+        else if (size_t(Rf_length(VECTOR_ELT(data_, v))) == volumeSize && TYPEOF(VECTOR_ELT(data_, v)) == storageType)
+            sources[v] = vectorData<DataType>(VECTOR_ELT(data_, v));
+        else
+        {
+            delete kernel;
+            throw std::runtime_error("All arrays must have the same size and storage type");
+        }
+    }
+    
+    Morpher<DataType> morpher(new Array<DataType>(dims, nVolumes > 0 ? sources[0] : NULL), kernel, elementOp, mergeOp);
+    setRestrictions(morpher, restrictions, renormalise);
+    
+    // Each result is allocated here, and the engine writes into them directly
+    const int resultType = morpher.preservesType() ? storageType : REALSXP;
+    RObject result = isList ? Rf_allocVector(VECSXP, nVolumes) : Rf_allocVector(resultType, nVolumes * volumeSize);
+    vector<DataType *> sameResults(nVolumes);
+    vector<double *> doubleResults(nVolumes);
+    for (size_t v=0; v<nVolumes; v++)
+    {
+        SEXP target = result;
+        size_t offset = v * volumeSize;
+        if (isList)
+        {
+            SET_VECTOR_ELT(result, v, Rf_allocVector(resultType, volumeSize));
+            target = VECTOR_ELT(result, v);
+            offset = 0;
+        }
+        if (resultType == REALSXP)
+            doubleResults[v] = REAL(target) + offset;
+        else
+            sameResults[v] = vectorData<DataType>(target) + offset;
+    }
+    
+    if (resultType == REALSXP)
+        morpher.run(sources, doubleResults);
     else
-        throw runtime_error("Unsupported merge operation specified");
+        morpher.run(sources, sameResults);
+    return result;
+}
+
+RcppExport SEXP morph_volumes (SEXP data_, SEXP kernel_, SEXP elementOp_, SEXP mergeOp_, SEXP restrictions_, SEXP renormalise_, SEXP threads_)
+{
+BEGIN_RCPP
+    Array<double> *kernelArray = arrayFromData(kernel_);
+    DiscreteKernel *kernel = new DiscreteKernel(kernelArray);
     
-    Morpher morpher(array, kernel, elementOp, mergeOp);
+    const ElementOp elementOp = elementOpFromString(as<string>(elementOp_));
+    const MergeOp mergeOp = mergeOpFromString(as<string>(mergeOp_));
     
     List restrictions(restrictions_);
-    morpher.setValidNeighbourhoods(as<int_vector>(restrictions["nNeighbours"]), as<int_vector>(restrictions["nNeighboursNot"]));
-    morpher.setValidValues(as<dbl_vector>(restrictions["value"]), as<dbl_vector>(restrictions["valueNot"]));
-    morpher.shouldRenormalise(as<bool>(renormalise_));
-    vector<double> &samples = morpher.run();
-    return wrap(samples);
+    const bool renormalise = as<bool>(renormalise_);
+    
+#ifdef _OPENMP
+    if (!Rf_isNull(threads_) && as<int>(threads_) > 0)
+        omp_set_num_threads(as<int>(threads_));
+#endif
+    
+    // The storage type of a list is that of its elements
+    const int storageType = (TYPEOF(data_) == VECSXP) ? (Rf_length(data_) > 0 ? TYPEOF(VECTOR_ELT(data_, 0)) : REALSXP) : TYPEOF(data_);
+    switch (storageType)
+    {
+        case INTSXP:
+        case LGLSXP:
+        return runMorpherOnVolumes<int>(data_, kernel, elementOp, mergeOp, restrictions, renormalise, storageType);
+        
+        case RAWSXP:
+        return runMorpherOnVolumes<unsigned char>(data_, kernel, elementOp, mergeOp, restrictions, renormalise, storageType);
+        
+        case REALSXP:
+        return runMorpherOnVolumes<double>(data_, kernel, elementOp, mergeOp, restrictions, renormalise, storageType);
+        
+        default:
+        delete kernel;
+        throw std::runtime_error("Target arrays must be numeric");
+    }
 END_RCPP
 }
 
-RcppExport SEXP connected_components (SEXP data_, SEXP kernel_)
+// A morph plan holds a morpher set up for arrays of one shape and storage
+// type, so that it can be applied repeatedly without repeating the setup. The
+// morpher's original is an empty view, which only supplies the dimensions
+class MorphPlan
+{
+public:
+    virtual ~MorphPlan () {}
+    virtual SEXP run (SEXP data_) = 0;
+};
+
+template <typename DataType>
+class TypedMorphPlan : public MorphPlan
+{
+private:
+    Morpher<DataType> morpher;
+    int storageType;
+    size_t size;
+    
+public:
+    TypedMorphPlan (const int_vector &dims, DiscreteKernel *kernel, const ElementOp elementOp, const MergeOp mergeOp, const List &restrictions, const bool renormalise, const int storageType)
+        : morpher(new Array<DataType>(dims, static_cast<DataType *>(NULL)), kernel, elementOp, mergeOp), storageType(storageType), size(1)
+    {
+        setRestrictions(morpher, restrictions, renormalise);
+        for (size_t i=0; i<dims.size(); i++)
+            size *= dims[i];
+    }
+    
+    SEXP run (SEXP data_)
+    {
+        if (TYPEOF(data_) != storageType || size_t(Rf_length(data_)) != size)
+            throw std::runtime_error("Array does not match the size and storage type of the plan");
+        
+        const int resultType = morpher.preservesType() ? storageType : REALSXP;
+        RObject result(Rf_allocVector(resultType, size));
+        if (resultType == REALSXP)
+            morpher.run(vectorData<DataType>(data_), REAL(result));
+        else
+            morpher.run(vectorData<DataType>(data_), vectorData<DataType>(result));
+        return result;
+    }
+};
+
+RcppExport SEXP morph_plan (SEXP kernel_, SEXP dims_, SEXP type_, SEXP elementOp_, SEXP mergeOp_, SEXP restrictions_, SEXP renormalise_)
 {
 BEGIN_RCPP
-    Array<double> *array = arrayFromData(data_);
+    Array<double> *kernelArray = arrayFromData(kernel_);
+    DiscreteKernel *kernel = new DiscreteKernel(kernelArray);
+    
+    const ElementOp elementOp = elementOpFromString(as<string>(elementOp_));
+    const MergeOp mergeOp = mergeOpFromString(as<string>(mergeOp_));
+    
+    const int_vector dims = as<int_vector>(dims_);
+    const string type = as<string>(type_);
+    List restrictions(restrictions_);
+    const bool renormalise = as<bool>(renormalise_);
+    
+    MorphPlan *plan;
+    if (type.compare("integer") == 0)
+        plan = new TypedMorphPlan<int>(dims, kernel, elementOp, mergeOp, restrictions, renormalise, INTSXP);
+    else if (type.compare("logical") == 0)
+        plan = new TypedMorphPlan<int>(dims, kernel, elementOp, mergeOp, restrictions, renormalise, LGLSXP);
+    else if (type.compare("raw") == 0)
+        plan = new TypedMorphPlan<unsigned char>(dims, kernel, elementOp, mergeOp, restrictions, renormalise, RAWSXP);
+    else
+        plan = new TypedMorphPlan<double>(dims, kernel, elementOp, mergeOp, restrictions, renormalise, REALSXP);
+    
+    return XPtr<MorphPlan>(plan);
+END_RCPP
+}
+
+RcppExport SEXP run_morph_plan (SEXP plan_, SEXP data_)
+{
+BEGIN_RCPP
+    // Plans can't be saved, so a reloaded one will have a null pointer
+    XPtr<MorphPlan> plan(plan_);
+    if (plan.get() == NULL)
+        throw std::runtime_error("Morph plan is no longer valid");
+    return plan->run(data_);
+END_RCPP
+}
+
+// Run a morpher on a file array, in slabs, writing the result to another file.
+// The specification of the result is returned
+template <typename DataType>
+SEXP runMorpherOnFile (const List &spec, DiscreteKernel *kernel, const ElementOp elementOp, const MergeOp mergeOp, const List &restrictions, const bool renormalise, SEXP result_, const size_t slabSize)
+{
+    MappedFile *output = NULL;
+    List result;
+    
+    try
+    {
+        Morpher<DataType> morpher(arrayFromFile<DataType>(spec), kernel, elementOp, mergeOp);
+        setRestrictions(morpher, restrictions, renormalise);
+        
+        if (morpher.preservesType())
+        {
+            result = resultSpec(spec, result_, as<string>(spec["type"]));
+            output = mapFileArray(result, MappedFile::ReadWrite);
+            morpher.runInSlabs(static_cast<DataType *>(output->data()), slabSize);
+        }
+        else
+        {
+            result = resultSpec(spec, result_);
+            output = mapFileArray(result, MappedFile::ReadWrite);
+            morpher.runInSlabs(static_cast<double *>(output->data()), slabSize);
+        }
+    }
+    catch (...)
+    {
+        delete output;
+        throw;
+    }
     
+    delete output;
+    return result;
+}
+
+RcppExport SEXP morph_file (SEXP data_, SEXP kernel_, SEXP elementOp_, SEXP mergeOp_, SEXP restrictions_, SEXP renormalise_, SEXP result_, SEXP slabSize_)
+{
+BEGIN_RCPP
     Array<double> *kernelArray = arrayFromData(kernel_);
     DiscreteKernel *kernel = new DiscreteKernel(kernelArray);
     
-    Componenter componenter(array, kernel);
-    vector<int> &labels = componenter.run();
-    return wrap(labels);
+    const ElementOp elementOp = elementOpFromString(as<string>(elementOp_));
+    const MergeOp mergeOp = mergeOpFromString(as<string>(mergeOp_));
+    
+    List spec(data_);
+    List restrictions(restrictions_);
+    const bool renormalise = as<bool>(renormalise_);
+    const size_t slabSize = static_cast<size_t>(as<int>(slabSize_));
+    const string type = as<string>(spec["type"]);
+    
+    if (type.compare("integer") == 0)
+        return runMorpherOnFile<int>(spec, kernel, elementOp, mergeOp, restrictions, renormalise, result_, slabSize);
+    else if (type.compare("raw") == 0)
+        return runMorpherOnFile<unsigned char>(spec, kernel, elementOp, mergeOp, restrictions, renormalise, result_, slabSize);
+    else if (type.compare("float") == 0)
+        return runMorpherOnFile<float>(spec, kernel, elementOp, mergeOp, restrictions, renormalise, result_, slabSize);
+    else
+        return runMorpherOnFile<double>(spec, kernel, elementOp, mergeOp, restrictions, renormalise, result_, slabSize);
 END_RCPP
 }
 
+template <typename DataType>
+SEXP runComponenter (Array<DataType> *array, DiscreteKernel *kernel)
+{
+    Componenter<DataType> componenter(array, kernel);
+    IntegerVector labels(array->size());
+    componenter.run(labels.begin());
+    return labels;
+}
+
+RcppExport SEXP connected_components (SEXP data_, SEXP kernel_)
+{
+BEGIN_RCPP
+    Array<double> *kernelArray = arrayFromData(kernel_);
+    DiscreteKernel *kernel = new DiscreteKernel(kernelArray);
+    
+    if (isFileArray(data_))
+    {
+        const List spec(data_);
+        const string type = as<string>(spec["type"]);
+        if (type.compare("integer") == 0)
+            return runComponenter(arrayFromFile<int>(spec), kernel);
+        else if (type.compare("raw") == 0)
+            return runComponenter(arrayFromFile<unsigned char>(spec), kernel);
+        else if (type.compare("float") == 0)
+            return runComponenter(arrayFromFile<float>(spec), kernel);
+        else
+            return runComponenter(arrayFromFile<double>(spec), kernel);
+    }
+    
+    switch (TYPEOF(data_))
+    {
+        case INTSXP:
+        case LGLSXP:
+        return runComponenter(arrayFromData<int>(data_), kernel);
+        
+        case RAWSXP:
+        return runComponenter(arrayFromData<unsigned char>(data_), kernel);
+        
+        default:
+        return runComponenter(arrayFromData(data_), kernel);
+    }
+END_RCPP
+}
+
+template <typename DataType>
+SEXP runDistancer (Array<DataType> *array, const bool usePixdim)
+{
+    Distancer<DataType> distancer(array, usePixdim);
+    NumericVector distances(array->size());
+    distancer.run(distances.begin());
+    return distances;
+}
+
 RcppExport SEXP distance_transform (SEXP data_, SEXP usePixdim_, SEXP threads_)
 {
 BEGIN_RCPP
-    Array<double> *array = arrayFromData(data_);
 #ifdef _OPENMP
     if (!Rf_isNull(threads_) && as<int>(threads_) > 0)
         omp_set_num_threads(as<int>(threads_));
 #endif
-    Distancer distancer(array, as<bool>(usePixdim_));
-    Array<double> *distances = distancer.run();
-    SEXP result = wrap(distances->getData());
-    delete distances;
+    
+    const bool usePixdim = as<bool>(usePixdim_);
+    switch (TYPEOF(data_))
+    {
+        case INTSXP:
+        case LGLSXP:
+        return runDistancer(arrayFromData<int>(data_), usePixdim);
+        
+        case RAWSXP:
+        return runDistancer(arrayFromData<unsigned char>(data_), usePixdim);
+        
+        default:
+        return runDistancer(arrayFromData(data_), usePixdim);
+    }
+END_RCPP
+}
+
+// The distance transform isn't local, so it is applied to the whole file
+// array at once, relying on the mappings to keep memory use down
+template <typename DataType>
+SEXP runDistancerOnFile (const List &spec, const bool usePixdim, SEXP result_)
+{
+    MappedFile *output = NULL;
+    const List result = resultSpec(spec, result_);
+    
+    try
+    {
+        output = mapFileArray(result, MappedFile::ReadWrite);
+        Distancer<DataType> distancer(arrayFromFile<DataType>(spec), usePixdim);
+        distancer.run(static_cast<double *>(output->data()));
+    }
+    catch (...)
+    {
+        delete output;
+        throw;
+    }
+    
+    delete output;
+    return result;
+}
+
+RcppExport SEXP distance_transform_file (SEXP data_, SEXP usePixdim_, SEXP result_, SEXP threads_)
+{
+BEGIN_RCPP
+#ifdef _OPENMP
+    if (!Rf_isNull(threads_) && as<int>(threads_) > 0)
+        omp_set_num_threads(as<int>(threads_));
+#endif
+    
+    List spec(data_);
+    const bool usePixdim = as<bool>(usePixdim_);
+    const string type = as<string>(spec["type"]);
+    
+    if (type.compare("integer") == 0)
+        return runDistancerOnFile<int>(spec, usePixdim, result_);
+    else if (type.compare("raw") == 0)
+        return runDistancerOnFile<unsigned char>(spec, usePixdim, result_);
+    else if (type.compare("float") == 0)
+        return runDistancerOnFile<float>(spec, usePixdim, result_);
+    else
+        return runDistancerOnFile<double>(spec, usePixdim, result_);
+END_RCPP
+}
+
+// Write the elementwise differences between two buffers into a result
+// vector. Differences can be negative, so they are stored as integers, not
+// in the original storage type, for logical and raw arrays
+template <typename DataType>
+void storeDifferences (const DataType *first, const DataType *second, const size_t n, RObject &result)
+{
+    if (TYPEOF(result) == INTSXP)
+    {
+        int * const output = INTEGER(result);
+        for (size_t i=0; i<n; i++)
+            output[i] = ElementTraits<int>::fromDouble(ElementTraits<DataType>::toDouble(first[i]) - ElementTraits<DataType>::toDouble(second[i]));
+    }
+    else
+    {
+        double * const output = REAL(result);
+        for (size_t i=0; i<n; i++)
+            output[i] = ElementTraits<DataType>::toDouble(first[i]) - ElementTraits<DataType>::toDouble(second[i]);
+    }
+}
+
+// Apply a compound operation built from erosion and dilation with the same
+// kernel. Where both are needed they are calculated in one pass, and
+// intermediate results are kept in native buffers rather than returned to R
+template <typename DataType>
+SEXP runCompoundMorph (Array<DataType> *array, DiscreteKernel *kernel, const bool flat, const string &operation, const bool extremes, const int storageType)
+{
+    Morpher<DataType> morpher(array, kernel, flat ? IdentityOp : PlusOp, MinOp);
+    const size_t n = array->size();
+    const bool difference = (operation.compare("opening") != 0 && operation.compare("closing") != 0);
+    RObject result(Rf_allocVector(difference && storageType != REALSXP ? INTSXP : storageType, n));
+    if (n == 0)
+        return result;
+    
+    DataType * const source = &(*array)[0];
+    std::vector<DataType> intermediate(n), filtered;
+    DataType * const output = difference ? NULL : vectorData<DataType>(result);
+    
+    if (operation.compare("gradient") == 0)
+    {
+        RObject erosion(Rf_allocVector(storageType, n)), dilation(Rf_allocVector(storageType, n));
+        DataType * const lower = vectorData<DataType>(erosion);
+        DataType * const upper = vectorData<DataType>(dilation);
+        morpher.runExtremes(source, lower, upper);
+        storeDifferences(upper, lower, n, result);
+        
+        if (extremes)
+        {
+            result.attr("erosion") = erosion;
+            result.attr("dilation") = dilation;
+        }
+    }
+    else if (operation.compare("opening") == 0 || operation.compare("whitetophat") == 0)
+    {
+        if (difference)
+            filtered.resize(n);
+        DataType * const target = difference ? &filtered.front() : output;
+        morpher.runExtremes(source, &intermediate.front(), static_cast<DataType *>(NULL));
+        morpher.runExtremes(&intermediate.front(), static_cast<DataType *>(NULL), target);
+        if (difference)
+            storeDifferences(source, target, n, result);
+    }
+    else if (operation.compare("closing") == 0 || operation.compare("blacktophat") == 0)
+    {
+        if (difference)
+            filtered.resize(n);
+        DataType * const target = difference ? &filtered.front() : output;
+        morpher.runExtremes(source, static_cast<DataType *>(NULL), &intermediate.front());
+        morpher.runExtremes(&intermediate.front(), target, static_cast<DataType *>(NULL));
+        if (difference)
+            storeDifferences(target, source, n, result);
+    }
+    else
+        throw runtime_error("Unsupported compound operation specified");
+    
+    return result;
+}
+
+RcppExport SEXP morph_compound (SEXP data_, SEXP kernel_, SEXP flat_, SEXP operation_, SEXP extremes_)
+{
+BEGIN_RCPP
+    DiscreteKernel *kernel = new DiscreteKernel(arrayFromData(kernel_));
+    const bool flat = as<bool>(flat_);
+    const string operation = as<string>(operation_);
+    const bool extremes = as<bool>(extremes_);
+    
+    // Flat kernels select existing values, so the storage type can be kept,
+    // but otherwise the data are converted to double precision up front
+    if (flat)
+    {
+        switch (TYPEOF(data_))
+        {
+            case INTSXP:
+            case LGLSXP:
+            return runCompoundMorph(arrayFromData<int>(data_), kernel, flat, operation, extremes, TYPEOF(data_));
+            
+            case RAWSXP:
+            return runCompoundMorph(arrayFromData<unsigned char>(data_), kernel, flat, operation, extremes, RAWSXP);
+        }
+    }
+    
+    return runCompoundMorph(arrayFromData(data_), kernel, flat, operation, extremes, REALSXP);
+END_RCPP
+}
+
+// Calculate several statistics of the neighbourhood of each element at once,
+// returning them as a list of vectors
+template <typename DataType>
+SEXP runLocalStats (Array<DataType> *array, DiscreteKernel *kernel)
+{
+    Morpher<DataType> morpher(array, kernel, IdentityOp, SumOp);
+    const size_t n = array->size();
+    NumericVector count(n), sum(n), mean(n), variance(n), minimum(n), maximum(n);
+    
+    // The statistics are written straight into the R vectors, in LocalStat order
+    double *statistics[nLocalStats] = { count.begin(), sum.begin(), mean.begin(), variance.begin(), minimum.begin(), maximum.begin() };
+    if (n > 0)
+        morpher.runStatistics(&(*array)[0], statistics);
+    
+    return List::create(Named("count") = count, Named("sum") = sum, Named("mean") = mean, Named("var") = variance, Named("min") = minimum, Named("max") = maximum);
+}
+
+RcppExport SEXP local_stats (SEXP data_, SEXP kernel_)
+{
+BEGIN_RCPP
+    DiscreteKernel *kernel = new DiscreteKernel(arrayFromData(kernel_));
+    switch (TYPEOF(data_))
+    {
+        case INTSXP:
+        case LGLSXP:
+        return runLocalStats(arrayFromData<int>(data_), kernel);
+        
+        case RAWSXP:
+        return runLocalStats(arrayFromData<unsigned char>(data_), kernel);
+        
+        default:
+        return runLocalStats(arrayFromData(data_), kernel);
+    }
+END_RCPP
+}
+
+// Find a global threshold level for the finite values of an array
+template <typename DataType>
+double thresholdLevel (const DataType * const data, const size_t length, const string &method)
+{
+    const Thresholder thresholder(data, length);
+    if (method.compare("otsu") == 0)
+        return thresholder.otsu();
+    else if (method.compare("kmeans") == 0)
+        return thresholder.kmeans();
+    else if (method.compare("triangle") == 0)
+        return thresholder.triangle();
+    else
+        throw runtime_error("Unsupported thresholding method specified");
+}
+
+RcppExport SEXP threshold_level (SEXP data_, SEXP method_)
+{
+BEGIN_RCPP
+    const string method = as<string>(method_);
+    const size_t length = Rf_xlength(data_);
+    switch (TYPEOF(data_))
+    {
+        case INTSXP:
+        case LGLSXP:
+        return wrap(thresholdLevel(vectorData<int>(data_), length, method));
+        
+        case RAWSXP:
+        return wrap(thresholdLevel(vectorData<unsigned char>(data_), length, method));
+        
+        case REALSXP:
+        return wrap(thresholdLevel(vectorData<double>(data_), length, method));
+        
+        default:
+        throw runtime_error("Data must be numeric");
+    }
+END_RCPP
+}
+
+// Apply a bilateral filter, either exactly, with the kernel as the spatial
+// weights, or approximately, using a grid sampled at intervals of the
+// kernel's standard deviation along each dimension
+template <typename DataType>
+SEXP runBilateralFilter (Array<DataType> *array, DiscreteKernel *kernel, const double rangeSigma, const bool grid)
+{
+    const size_t n = array->size();
+    NumericVector result(n);
+    if (n == 0)
+    {
+        delete array;
+        delete kernel;
+        return result;
+    }
+    
+    if (grid)
+    {
+        // The spatial standard deviations are estimated from the second
+        // moments of the kernel's absolute weights
+        const Array<double> *kernelArray = kernel->getArray();
+        const Neighbourhood kernelNeighbourhood = kernelArray->getNeighbourhood();
+        const int nDims = array->getDimensionality();
+        const int nKernelDims = kernelNeighbourhood.locs.ncol();
+        std::vector<double> sigmas(nDims, 0.0);
+        double total = 0.0;
+        for (size_t k=0; k<kernelNeighbourhood.size; k++)
+        {
+            const double weight = kernelArray->at(k);
+            if (R_IsNA(weight))
+                continue;
+            total += fabs(weight);
+            for (int j=0; j<std::min(nDims,nKernelDims); j++)
+                sigmas[j] += fabs(weight) * kernelNeighbourhood.locs(k,j) * kernelNeighbourhood.locs(k,j);
+        }
+        for (int j=0; j<nDims; j++)
+            sigmas[j] = (total > 0.0) ? sqrt(sigmas[j] / total) : 0.0;
+        
+        BilateralGrid bilateralGrid(array->getDimensions(), sigmas, rangeSigma);
+        bilateralGrid.run(&(*array)[0], result.begin());
+        delete array;
+        delete kernel;
+    }
+    else
+    {
+        Morpher<DataType> morpher(array, kernel, IdentityOp, SumOp);
+        morpher.runBilateral(&(*array)[0], result.begin(), rangeSigma);
+    }
+    
+    return result;
+}
+
+RcppExport SEXP bilateral_filter (SEXP data_, SEXP kernel_, SEXP rangeSigma_, SEXP grid_)
+{
+BEGIN_RCPP
+    DiscreteKernel *kernel = new DiscreteKernel(arrayFromData(kernel_));
+    const double rangeSigma = as<double>(rangeSigma_);
+    const bool grid = as<bool>(grid_);
+    switch (TYPEOF(data_))
+    {
+        case INTSXP:
+        case LGLSXP:
+        return runBilateralFilter(arrayFromData<int>(data_), kernel, rangeSigma, grid);
+        
+        case RAWSXP:
+        return runBilateralFilter(arrayFromData<unsigned char>(data_), kernel, rangeSigma, grid);
+        
+        default:
+        return runBilateralFilter(arrayFromData(data_), kernel, rangeSigma, grid);
+    }
+END_RCPP
+}
+
+// Run a life-like cellular automaton for the specified number of generations,
+// returning either the final state, or the state after every k generations,
+// one after another. If the state stops changing, the generation at which
+// it became stable is also recorded, and no further work is done
+RcppExport SEXP run_automaton (SEXP init_, SEXP birth_, SEXP survival_, SEXP steps_, SEXP every_, SEXP threads_)
+{
+BEGIN_RCPP
+#ifdef _OPENMP
+    if (!Rf_isNull(threads_) && as<int>(threads_) > 0)
+        omp_set_num_threads(as<int>(threads_));
+#endif
+    
+    IntegerVector init(init_);
+    Automaton automaton(dimensionsOf(init), as<int_vector>(birth_), as<int_vector>(survival_));
+    automaton.setState(init.begin());
+    
+    if (!(as<double>(steps_) >= 0.0) || !(as<double>(every_) >= 0.0))
+        throw std::runtime_error("The number of steps and snapshot interval must be nonnegative");
+    const size_t steps = static_cast<size_t>(as<double>(steps_));
+    const size_t every = static_cast<size_t>(as<double>(every_));
+    const size_t nCells = init.length();
+    const size_t nSnapshots = (every > 0) ? steps / every : 1;
+    IntegerVector result(nCells * nSnapshots);
+    
+    bool stable = false;
+    size_t stableAt = 0, snapshot = 0;
+    for (size_t generation=1; generation<=steps; generation++)
+    {
+        if (automaton.step())
+        {
+            if (every > 0 && generation % every == 0)
+                automaton.getState(result.begin() + (snapshot++) * nCells);
+        }
+        else
+        {
+            stable = true;
+            stableAt = generation - 1;
+            break;
+        }
+        
+        if (generation % 1024 == 0)
+            checkUserInterrupt();
+    }
+    
+    // Any remaining snapshots are all the same as the final state
+    if (every == 0)
+        automaton.getState(result.begin());
+    else
+    {
+        for (; snapshot<nSnapshots; snapshot++)
+            automaton.getState(result.begin() + snapshot * nCells);
+    }
+    
+    if (stable)
+        result.attr("stable") = static_cast<double>(stableAt);
     return result;
 END_RCPP
 }
@@ -257,11 +1231,22 @@ static R_CallMethodDef callMethods[] = {
     { "is_binary",              (DL_FUNC) &is_binary,               1 },
     { "is_symmetric",           (DL_FUNC) &is_symmetric,            1 },
     { "get_neighbourhood",      (DL_FUNC) &get_neighbourhood,       2 },
-    { "sample_kernel",          (DL_FUNC) &sample_kernel,           2 },
+    { "sample_kernel",          (DL_FUNC) &sample_kernel,           3 },
     { "resample",               (DL_FUNC) &resample,                4 },
     { "morph",                  (DL_FUNC) &morph,                   6 },
     { "connected_components",   (DL_FUNC) &connected_components,    2 },
     { "distance_transform",     (DL_FUNC) &distance_transform,      3 },
+    { "resample_file",          (DL_FUNC) &resample_file,           7 },
+    { "morph_file",             (DL_FUNC) &morph_file,              8 },
+    { "distance_transform_file",(DL_FUNC) &distance_transform_file, 4 },
+    { "morph_volumes",          (DL_FUNC) &morph_volumes,           7 },
+    { "morph_plan",             (DL_FUNC) &morph_plan,              7 },
+    { "run_morph_plan",         (DL_FUNC) &run_morph_plan,          2 },
+    { "morph_compound",         (DL_FUNC) &morph_compound,          5 },
+    { "local_stats",            (DL_FUNC) &local_stats,             2 },
+    { "threshold_level",        (DL_FUNC) &threshold_level,         2 },
+    { "bilateral_filter",       (DL_FUNC) &bilateral_filter,        4 },
+    { "run_automaton",          (DL_FUNC) &run_automaton,           6 },
     { NULL, NULL, 0 }
 };
 